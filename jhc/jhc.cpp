@@ -10,10 +10,15 @@
 
 cli::Error_e cmdTest( CLIARGS args, cli::Param_t prm) {
 
-   printf( "cmac_TEST returned  : %s\n", (cmac_TEST()   ? "PASS" : "FAIL" ));
-   printf( "hmac_TEST returned  : %s\n", (hmac_TEST()   ? "PASS" : "FAIL" ));
-//   printf( "PBKDF2_TEST returned: %s\n", (PBKDF2_TEST() ? "PASS" : "FAIL" ));
-//   printf( "WPAPSK_TEST returned: %s\n", (WPAPSK_TEST() ? "PASS" : "FAIL" ));   
+   printf( "aes_TEST returned      : %s\n", (aes_TEST()       ? "PASS" : "FAIL" ));
+   printf( "sha1_TEST returned     : %s\n", (sha1_TEST()      ? "PASS" : "FAIL" ));
+   printf( "sha2_TEST returned     : %s\n", (sha2_TEST()      ? "PASS" : "FAIL" ));
+   printf( "cmac_TEST returned     : %s\n", (cmac_TEST()      ? "PASS" : "FAIL" ));
+   printf( "container_TEST returned: %s\n", (container_TEST() ? "PASS" : "FAIL" ));
+   printf( "gcm_TEST returned      : %s\n", (gcm_TEST()       ? "PASS" : "FAIL" ));
+   printf( "hmac_TEST returned     : %s\n", (hmac_TEST()      ? "PASS" : "FAIL" ));
+   printf( "PBKDF2_TEST returned   : %s\n", (PBKDF2_TEST()    ? "PASS" : "FAIL" ));
+   printf( "WPAPSK_TEST returned   : %s\n", (WPAPSK_TEST()    ? "PASS" : "FAIL" ));
 
    return cli::ERR_NOERROR;         
 }
@@ -368,6 +373,276 @@ cli::Error_e cmdGetCwd( CLIARGS args, cli::Param_t prm) {
    return cli::ERR_GENERAL;
 }
 
+// ============================================================================ 
+// File encryption.
+//
+// A file is sealed into an AesChunked128 container (jhbKrypto.h) whose keys 
+// come from the passphrase through PBKDF2, salted with the container's nonce.
+// The data streams through a three-stage pipeline over a ring of slots:
+//
+//    reader thread  ->  cipher (this thread + workers)  ->  writer thread
+//
+// A slot is a batch of whole chunks, in and out.  Each stage hands its slot on
+// and starts the next, so the reads, the sealing/opening and the writes all 
+// overlap: the disk or the CPUs, whichever is slower, sets the pace.  Chunks 
+// are checked before they're written, and a failed decrypt deletes the output.
+// ============================================================================ 
+
+#define JHC_CHUNK_LEN  (256 * 1024)   // container chunk, plain text bytes
+#define JHC_SLOTS      4              // pipeline ring (3 stages: one spare)
+#define JHC_KDF_COUNT  100000         // PBKDF2 iterations for the passphrase
+
+// JHC_KDF_COUNT is fixed rather than calibrated (PBKDF2_calibrate): the 
+// container header doesn't record it, so decrypting has to use the same count
+// that encrypting did, whatever machine it runs on.
+
+struct _pipe_slot_t {
+   MemBuf            in, out;
+   unsigned __int64  first;           // first chunk
+   int               chunks;          // 0: end of the stream
+   size_t            inLen, outLen;
+};
+
+struct _pipe_t {
+   const AesChunked128 *ac;
+   bool                 bSeal;
+   HANDLE               hIn, hOut;
+   HANDLE               hFull;        // semaphores: slots ready for the cipher,
+   HANDLE               hDone;        //   for the writer,
+   HANDLE               hFree;        //   and for the reader
+   int                  batch;        // chunks per slot
+   int                  workers;      // most cipher threads
+   size_t               inStride;     // a full chunk, in and out
+   size_t               outStride;
+   _pipe_slot_t         slot[JHC_SLOTS];
+   _pipe_slot_t        *cur;          // slot the workers are on
+   int                  curWorkers;
+   volatile LONG        err;          // first failure (cli::Error_e)
+};
+
+static void _pipeFail( _pipe_t *p, cli::Error_e err ) {
+   InterlockedCompareExchange( &p->err, err, cli::ERR_NOERROR );
+}
+
+static bool _readAll( HANDLE h, BYTE *p, size_t n ) {
+   while (0 < n) {
+      DWORD got = 0;
+      if (!ReadFile( h, p, (DWORD)min( n, (size_t)0x40000000 ), &got, 0 ) || (0 == got)) { return false; }
+      p += got; n -= got;
+   }
+   return true;
+}
+
+static bool _writeAll( HANDLE h, const BYTE *p, size_t n ) {
+   while (0 < n) {
+      DWORD put = 0;
+      if (!WriteFile( h, p, (DWORD)min( n, (size_t)0x40000000 ), &put, 0 ) || (0 == put)) { return false; }
+      p += put; n -= put;
+   }
+   return true;
+}
+
+static DWORD WINAPI _pipeReader( LPVOID lpParameter ) {
+   _pipe_t *p = (_pipe_t *)lpParameter;
+   const AesChunked128 *ac = p->ac;
+
+   unsigned __int64 i = 0, n = ac->Chunks();
+   for (int k=0; ; k++) {
+      WaitForSingleObject( p->hFree, INFINITE );
+      _pipe_slot_t &s = p->slot[k % JHC_SLOTS];
+
+      s.first  = i;
+      s.chunks = (cli::ERR_NOERROR == p->err) ? (int)min( n - i, (unsigned __int64)p->batch ) : 0;
+      s.inLen  = s.outLen = 0;
+      for (int j=0; j<s.chunks; j++) {
+         size_t ptLen = ac->ChunkPtLen( i + j ), pkgLen = ac->ChunkPkgLen( i + j );
+         s.inLen  += p->bSeal ? ptLen  : pkgLen;
+         s.outLen += p->bSeal ? pkgLen : ptLen;
+      }
+      if ((0 < s.chunks) && !_readAll( p->hIn, s.in, s.inLen )) {
+         _pipeFail( p, cli::ERR_READFAIL );
+         s.chunks = 0;
+      }
+      i += s.chunks;
+
+      bool bEnd = (0 == s.chunks);
+      ReleaseSemaphore( p->hFull, 1, 0 );
+      if (bEnd) { return 0; }
+   }
+}
+
+static void _pipeWorker( void *ctx, int w ) {
+   _pipe_t      *p = (_pipe_t *)ctx;
+   _pipe_slot_t *s = p->cur;
+
+   int end = s->chunks * (w + 1) / p->curWorkers;
+   for (int j=s->chunks * w / p->curWorkers; j<end; j++) {
+      const BYTE *in  = s->in  + j * p->inStride;
+      BYTE       *out = s->out + j * p->outStride;
+      if (p->bSeal) { p->ac->SealChunk( s->first + j, in, out ); }
+      else if (!p->ac->OpenChunk( s->first + j, in, out )) { _pipeFail( p, cli::ERR_INVALIDARG ); }
+   }
+}
+
+static DWORD WINAPI _pipeWriter( LPVOID lpParameter ) {
+   _pipe_t *p = (_pipe_t *)lpParameter;
+
+   for (int k=0; ; k++) {
+      WaitForSingleObject( p->hDone, INFINITE );
+      _pipe_slot_t &s = p->slot[k % JHC_SLOTS];
+      if (0 == s.chunks) { return 0; }
+
+      if ((cli::ERR_NOERROR == p->err) && !_writeAll( p->hOut, s.out, s.outLen )) {
+         _pipeFail( p, cli::ERR_WRITEFAIL );
+      }
+      ReleaseSemaphore( p->hFree, 1, 0 );
+   }
+}
+
+// Streams the chunks from hIn to hOut (both positioned at the first chunk).
+// Returns ERR_INVALIDARG if a chunk doesn't check out.
+static cli::Error_e _pipeRun( const AesChunked128 &ac, bool bSeal, HANDLE hIn, HANDLE hOut, int nThreads ) {
+
+   _pipe_t p;
+   p.ac         = &ac;
+   p.bSeal      = bSeal;
+   p.hIn        = hIn;
+   p.hOut       = hOut;
+   p.workers    = (0 == nThreads) ? CpuCount() : max( 1, nThreads );
+   p.batch      = (int)min( (unsigned __int64)max( 16, 2 * p.workers ), max( ac.Chunks(), (unsigned __int64)1 ));
+   p.inStride   = bSeal ? ac.ChunkLen() : AesCbcCmac128::CalcSize( ac.ChunkLen());
+   p.outStride  = bSeal ? AesCbcCmac128::CalcSize( ac.ChunkLen()) : ac.ChunkLen();
+   p.cur        = 0;
+   p.curWorkers = 0;
+   p.err        = cli::ERR_NOERROR;
+
+   for (int k=0; k<JHC_SLOTS; k++) {
+      if (!p.slot[k].in .alloc( p.batch * p.inStride  ) ||
+          !p.slot[k].out.alloc( p.batch * p.outStride )) { return cli::ERR_MEMORY; }
+   }
+
+   p.hFull = CreateSemaphore( 0, 0        , JHC_SLOTS, 0 );
+   p.hDone = CreateSemaphore( 0, 0        , JHC_SLOTS, 0 );
+   p.hFree = CreateSemaphore( 0, JHC_SLOTS, JHC_SLOTS, 0 );
+
+   HANDLE hReader = CreateThread( 0, 0, _pipeReader, &p, CREATE_SUSPENDED, 0 );
+   HANDLE hWriter = CreateThread( 0, 0, _pipeWriter, &p, CREATE_SUSPENDED, 0 );
+   if (p.hFull && p.hDone && p.hFree && hReader && hWriter) {
+      ResumeThread( hReader );
+      ResumeThread( hWriter );
+
+      // The cipher stage.  After a failure the slots still go round (empty-handed)
+      // until the reader sees it and ends the stream.
+      for (int k=0; ; k++) {
+         WaitForSingleObject( p.hFull, INFINITE );
+         _pipe_slot_t &s = p.slot[k % JHC_SLOTS];
+         bool bEnd = (0 == s.chunks);     // the slot isn't ours once it's passed on
+
+         if (!bEnd && (cli::ERR_NOERROR == p.err)) {
+            p.cur        = &s;
+            p.curWorkers = min( p.workers, s.chunks );
+            if (1 == p.curWorkers) { _pipeWorker( &p, 0 ); }
+            else                   { RunWorkers( p.curWorkers, _pipeWorker, &p ); }
+         }
+         ReleaseSemaphore( p.hDone, 1, 0 );
+         if (bEnd) { break; }
+      }
+      WaitForSingleObject( hReader, INFINITE );
+      WaitForSingleObject( hWriter, INFINITE );
+   }
+   else {
+      if (hReader) { TerminateThread( hReader, 0 ); }
+      if (hWriter) { TerminateThread( hWriter, 0 ); }
+      p.err = cli::ERR_GENERAL;
+   }
+
+   HANDLE h[] = { hReader, hWriter, p.hFull, p.hDone, p.hFree };
+   for (int i=0; i<NELEM(h); i++) { if (h[i]) { CloseHandle( h[i] ); }}
+
+   // Plain text is in the in buffers when sealing, the out buffers when opening.
+   for (int k=0; k<JHC_SLOTS; k++) { p.slot[k].in.szero(); p.slot[k].out.szero(); }
+   return (cli::Error_e)p.err;
+}
+
+// enc/dec <in> <out> <passphrase> [threads]
+static cli::Error_e _cryptFile( CLIARGS args, bool bSeal ) {
+
+   if (args.size() < 4) {
+      printf( "***ERROR: You must enter: <in-file>, <out-file>, <passphrase> [, <threads>]\n" );
+      return cli::ERR_MISSINGARG;
+   }
+   int nThreads = (4 < args.size()) ? _tcstol( args[4].c_str(), 0, 0 ) : 0;
+   CvtStrA sPass( args[3].c_str() );
+
+   HANDLE hIn = CreateFile( args[1].c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0 );
+   if (INVALID_HANDLE_VALUE == hIn) {
+      _tprintf( _T("***ERROR: Can't open %s\n"), args[1].c_str() );
+      return cli::ERR_OPENFAIL;
+   }
+   LARGE_INTEGER inSize = { 0 };
+   if (!GetFileSizeEx( hIn, &inSize )) {
+      _tprintf( _T("***ERROR: Can't get the size of %s\n"), args[1].c_str() );
+      CloseHandle( hIn );
+      return cli::ERR_READFAIL;
+   }
+
+   // The header: new for sealing, read (and checked, once there's a key) for opening.
+   BYTE hdr[AesChunked128::HeaderLen], nonce[AesChunked128::NonceLen];
+   if (bSeal) { GenKeyBytes( nonce, sizeof nonce ); }
+   else {
+      if ((inSize.QuadPart < AesChunked128::HeaderLen) || !_readAll( hIn, hdr, sizeof hdr )) {
+         _tprintf( _T("***ERROR: %s is not an encrypted file.\n"), args[1].c_str() );
+         CloseHandle( hIn );
+         return cli::ERR_INVALIDARG;
+      }
+      memcpy( nonce, AesChunked128::HeaderNonce( hdr ), sizeof nonce );
+   }
+
+   KeyBuf keys( 2 * AesCbcCmac128::KeyLen );
+   PBKDF2( (PCBYTE)sPass.Psz(), (int)sPass.Len(), nonce, sizeof nonce, JHC_KDF_COUNT, keys.size(), keys, 0 );
+   AesChunked128 ac( keys, keys + AesCbcCmac128::KeyLen );
+
+   if (bSeal) { ac.Create( inSize.QuadPart, JHC_CHUNK_LEN, nonce, hdr ); }
+   else if (!ac.ReadHeader( hdr ) || (ac.Size() != (unsigned __int64)inSize.QuadPart)) {
+      printf( "***ERROR: Wrong passphrase, or the file is damaged.\n" );
+      CloseHandle( hIn );
+      return cli::ERR_INVALIDARG;
+   }
+
+   HANDLE hOut = CreateFile( args[2].c_str(), GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, 0 );
+   if (INVALID_HANDLE_VALUE == hOut) {
+      _tprintf( _T("***ERROR: Can't create %s\n"), args[2].c_str() );
+      CloseHandle( hIn );
+      return cli::ERR_OPENFAIL;
+   }
+
+   usTimer t;
+   cli::Error_e err = cli::ERR_NOERROR;
+   if (bSeal && !_writeAll( hOut, hdr, sizeof hdr )) { err = cli::ERR_WRITEFAIL; }
+   if (cli::ERR_NOERROR == err) { err = _pipeRun( ac, bSeal, hIn, hOut, nThreads ); }
+   double secs = t.Seconds();
+
+   CloseHandle( hIn  );
+   CloseHandle( hOut );
+
+   switch (err) {
+   case cli::ERR_NOERROR:
+      printf( "%s %I64u bytes in %.3f s: %.1f MB/s\n", (bSeal ? "Encrypted" : "Decrypted"), 
+              ac.PtLen(), secs, (double)(__int64)ac.PtLen() / (1024 * 1024) / max( secs, 1e-6 ));
+      return cli::ERR_NOERROR;
+   case cli::ERR_INVALIDARG: printf( "***ERROR: The file is damaged.\n" );     break;
+   case cli::ERR_READFAIL  : printf( "***ERROR: Read failed.\n" );             break;
+   case cli::ERR_WRITEFAIL : printf( "***ERROR: Write failed.\n" );            break;
+   case cli::ERR_MEMORY    : printf( "***ERROR: Out of memory.\n" );           break;
+   default                 : printf( "***ERROR: Couldn't start the threads.\n" ); break;
+   }
+   DeleteFile( args[2].c_str() );
+   return err;
+}
+
+cli::Error_e cmdEncrypt( CLIARGS args, cli::Param_t prm) { return _cryptFile( args, true  ); }
+cli::Error_e cmdDecrypt( CLIARGS args, cli::Param_t prm) { return _cryptFile( args, false ); }
+
 
 // ============================================================================ 
 // Command table.
@@ -383,6 +658,18 @@ cli::CmdSpec_t cliCommands[] =
                        , _T("<1> - text\n")
                          _T("<2> - key\n")                      
                        }
+,{ _T("enc"), cmdEncrypt, _T("Encrypts a file (AES-128 CBC + CMAC, chunked container)")
+                       , _T("<1> - input file\n")
+                         _T("<2> - output file\n")
+                         _T("<3> - passphrase\n")
+                         _T("<4> - threads (default: one per CPU)\n")
+                       }
+,{ _T("dec"), cmdDecrypt, _T("Decrypts and checks a file made by enc")
+                       , _T("<1> - input file\n")
+                         _T("<2> - output file\n")
+                         _T("<3> - passphrase\n")
+                         _T("<4> - threads (default: one per CPU)\n")
+                       }
 ,{ _T("rht"), cmdRHash , _T("Runs tests on the registry hash object.") }
 ,{ _T("ktt"), cmdKTree , _T("Runs tests on the key tree object.") }
 ,{ _T("prt"), cmdPanReg, _T("Runs tests on the PanReg object.") }
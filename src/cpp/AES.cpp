@@ -0,0 +1,1007 @@
+// ----------------------------------------------------------------------------
+//
+// AES.CPP
+//
+//   AES (FIPS 197) with the implementation picked at run time: AES-NI where
+//   the CPU has it, otherwise the OpenSSL table code (aes_core.c).  Modes
+//   that can run eight blocks at once (CBC decryption, CTR, ECB) use constant-
+//   time bitsliced SSE2 code instead of the tables when there is no AES-NI.
+//
+// ----------------------------------------------------------------------------
+//
+// AES-NI notes:
+//
+//   AESENC/AESENCLAST do one encryption round; AESDEC/AESDECLAST one round
+//   of the "equivalent inverse cipher" (FIPS 197 5.3.5), whose schedule is
+//   the encryption schedule reversed, with InvMixColumns (AESIMC) applied to
+//   all but the first and last round keys.  OpenSSL's decryption schedule is
+//   built the same way, so the two formats differ only in byte order: OpenSSL
+//   keeps each round key as big-endian words, AES-NI as plain bytes.
+//
+// ----------------------------------------------------------------------------
+
+#include "jhbKrypto.h"
+#include "jhb_simd.h"
+#include "jhb_aes.h"
+
+extern "C" {
+   #include <openssl/modes.h>
+}
+
+#define BLK_SIZE AES_BLOCK_SIZE
+
+// CTR counter block: the 16 bytes as one big-endian number, in two halves.
+struct _ctr_t { unsigned __int64 hi, lo; };
+
+static inline unsigned __int64 _ld64( const BYTE *p ) {
+   unsigned __int64 v = 0;
+   for (int i=0; i<8; i++) { v = (v << 8) | p[i]; }
+   return v;
+}
+static inline void _st64( unsigned __int64 v, BYTE *p ) {
+   for (int i=7; 0<=i; i--) { p[i] = (BYTE)v; v >>= 8; }
+}
+static inline void _ctrAdd( _ctr_t &c, unsigned __int64 n ) {
+   c.lo += n;
+   if (c.lo < n) { c.hi++; }
+}
+
+// --- AES-NI -----------------------------------------------------------------
+
+#ifdef JHB_AESNI
+
+static bool _aesni() { return 0 != (CpuFeatures() & CPU_AESNI); }
+
+// Round key r.  (AES_KEY is only word-aligned.)
+static inline __m128i _rk( const AES_KEY *ks, int r ) {
+   return _mm_loadu_si128( (const __m128i *)ks->rd_key + r );
+}
+static inline void _setRk( AES_KEY *ks, int r, __m128i k ) {
+   _mm_storeu_si128( (__m128i *)ks->rd_key + r, k );
+}
+
+// One step of the AES-128 key expansion; t is AESKEYGENASSIST of the previous
+// round key.
+static inline __m128i _aesni_exp128( __m128i k, __m128i t ) {
+   t = _mm_shuffle_epi32( t, 0xff );
+   k = _mm_xor_si128( k, _mm_slli_si128( k, 4 ));
+   k = _mm_xor_si128( k, _mm_slli_si128( k, 4 ));
+   k = _mm_xor_si128( k, _mm_slli_si128( k, 4 ));
+   return _mm_xor_si128( k, t );
+}
+#define AESNI_EXP128(k,rcon) _aesni_exp128( k, _mm_aeskeygenassist_si128( k, rcon ))
+
+// Converts an OpenSSL schedule, in place, to the AES-NI byte order.
+static void _aesni_fromTable( AES_KEY *ks ) {
+   for (int i=0; i<4*(ks->rounds+1); i++) {
+      UINT  v = ks->rd_key[i];
+      BYTE *p = (BYTE *)&ks->rd_key[i];
+      p[0] = (BYTE)(v >> 24); p[1] = (BYTE)(v >> 16); p[2] = (BYTE)(v >> 8); p[3] = (BYTE)v;
+   }
+}
+
+static int _aesni_set_encrypt_key( const BYTE *key, int bits, AES_KEY *ks )
+{
+   // AES-192/256: OpenSSL's expansion, reordered.
+   if (128 != bits) {
+      int rc = private_AES_set_encrypt_key( key, bits, ks );
+      if (0 == rc) { _aesni_fromTable( ks ); }
+      return rc;
+   }
+   if (!key || !ks) { return -1; }
+
+   __m128i k = _mm_loadu_si128( (const __m128i *)key );
+   _setRk( ks,  0, k );
+   k = AESNI_EXP128( k, 0x01 ); _setRk( ks,  1, k );
+   k = AESNI_EXP128( k, 0x02 ); _setRk( ks,  2, k );
+   k = AESNI_EXP128( k, 0x04 ); _setRk( ks,  3, k );
+   k = AESNI_EXP128( k, 0x08 ); _setRk( ks,  4, k );
+   k = AESNI_EXP128( k, 0x10 ); _setRk( ks,  5, k );
+   k = AESNI_EXP128( k, 0x20 ); _setRk( ks,  6, k );
+   k = AESNI_EXP128( k, 0x40 ); _setRk( ks,  7, k );
+   k = AESNI_EXP128( k, 0x80 ); _setRk( ks,  8, k );
+   k = AESNI_EXP128( k, 0x1b ); _setRk( ks,  9, k );
+   k = AESNI_EXP128( k, 0x36 ); _setRk( ks, 10, k );
+   ks->rounds = 10;
+
+   k = _mm_setzero_si128();
+   return 0;
+}
+
+static int _aesni_set_decrypt_key( const BYTE *key, int bits, AES_KEY *ks )
+{
+   AES_KEY ek;
+   int rc = _aesni_set_encrypt_key( key, bits, &ek );
+   if (0 != rc) { return rc; }
+
+   int nr = ek.rounds;
+   _setRk( ks, 0, _rk( &ek, nr ));
+   for (int r=1; r<nr; r++) { _setRk( ks, r, _mm_aesimc_si128( _rk( &ek, nr-r ))); }
+   _setRk( ks, nr, _rk( &ek, 0 ));
+   ks->rounds = nr;
+
+   SecureZero( &ek, sizeof ek );
+   return 0;
+}
+
+// One block through all NR rounds.  Everything from here down takes the round
+// count as a template parameter, so each round loop has a constant trip count
+// and is unrolled; AESNI_NR() picks the instance once per call.
+template <int NR> static inline __m128i _aesni_enc( __m128i b, const AES_KEY *ks ) {
+   b = _mm_xor_si128( b, _rk( ks, 0 ));
+   for (int r=1; r<NR; r++) { b = _mm_aesenc_si128( b, _rk( ks, r )); }
+   return _mm_aesenclast_si128( b, _rk( ks, NR ));
+}
+
+template <int NR> static inline __m128i _aesni_dec( __m128i b, const AES_KEY *ks ) {
+   b = _mm_xor_si128( b, _rk( ks, 0 ));
+   for (int r=1; r<NR; r++) { b = _mm_aesdec_si128( b, _rk( ks, r )); }
+   return _mm_aesdeclast_si128( b, _rk( ks, NR ));
+}
+
+// Runs fn<NR> args for the schedule's key size: 10, 12 or 14 rounds.
+#define AESNI_NR(ks, fn, args)                                 \
+   switch ((ks)->rounds) {                                     \
+      case 10: fn<10> args; break;                             \
+      case 12: fn<12> args; break;                             \
+      default: fn<14> args; break;                             \
+   }
+
+template <int NR> static void _aesni_ecb( const BYTE *in, BYTE *out, size_t blocks, const AES_KEY *ks ) {
+   for (; blocks; blocks--, in+=BLK_SIZE, out+=BLK_SIZE) {
+      _mm_storeu_si128( (__m128i *)out, _aesni_enc<NR>( _mm_loadu_si128( (const __m128i *)in ), ks ));
+   }
+}
+
+template <int NR> static void _aesni_decrypt( const BYTE *in, BYTE *out, const AES_KEY *ks ) {
+   _mm_storeu_si128( (__m128i *)out, _aesni_dec<NR>( _mm_loadu_si128( (const __m128i *)in ), ks ));
+}
+
+// CBC over whole blocks.  in may equal out.  The last chaining value goes to
+// 'chain' (iv itself is left alone, as in this tree's cbc128.c).
+template <int NR> static void _aesni_cbc_encrypt( const BYTE *in, BYTE *out, size_t blocks, const AES_KEY *ks, const BYTE *iv, BYTE *chain )
+{
+   __m128i c = _mm_loadu_si128( (const __m128i *)iv );
+   for (; blocks; blocks--, in+=BLK_SIZE, out+=BLK_SIZE) {
+      c = _aesni_enc<NR>( _mm_xor_si128( c, _mm_loadu_si128( (const __m128i *)in )), ks );
+      _mm_storeu_si128( (__m128i *)out, c );
+   }
+   _mm_storeu_si128( (__m128i *)chain, c );
+}
+
+// The same chaining with only the final value kept (CBC-MAC), in X.
+template <int NR> static void _aesni_cbc_mac( const BYTE *in, size_t blocks, const AES_KEY *ks, BYTE *X )
+{
+   __m128i c = _mm_loadu_si128( (const __m128i *)X );
+   for (; blocks; blocks--, in+=BLK_SIZE) {
+      c = _aesni_enc<NR>( _mm_xor_si128( c, _mm_loadu_si128( (const __m128i *)in )), ks );
+   }
+   _mm_storeu_si128( (__m128i *)X, c );
+}
+
+// CBC encryption fused with a CBC-MAC of the ciphertext it produces (for 
+// encrypt-then-MAC).  Both chains are serial, one AESENC after another, but
+// independent of each other, so running them in one loop fills each one's 
+// latency gaps with the other.  X is the pending MAC block: the chaining value
+// XORed with the last block absorbed, not yet encrypted.  The MAC of ciphertext
+// block i thus runs alongside the encryption of block i+1.
+template <int NR> static void _aesni_cbc_encrypt_mac( const BYTE *in, BYTE *out, size_t blocks, const AES_KEY *ks, BYTE *chain, const AES_KEY *mks, BYTE *X )
+{
+   __m128i c = _mm_loadu_si128( (const __m128i *)chain );
+   __m128i x = _mm_loadu_si128( (const __m128i *)X );
+   for (; blocks; blocks--, in+=BLK_SIZE, out+=BLK_SIZE) {
+      c = _mm_xor_si128( _mm_xor_si128( c, _mm_loadu_si128( (const __m128i *)in )), _rk( ks, 0 ));
+      x = _mm_xor_si128( x, _rk( mks, 0 ));
+      for (int r=1; r<NR; r++) { 
+         c = _mm_aesenc_si128( c, _rk( ks , r )); 
+         x = _mm_aesenc_si128( x, _rk( mks, r )); 
+      }
+      c = _mm_aesenclast_si128( c, _rk( ks , NR ));
+      x = _mm_aesenclast_si128( x, _rk( mks, NR ));
+      _mm_storeu_si128( (__m128i *)out, c );
+      x = _mm_xor_si128( x, c );
+   }
+   _mm_storeu_si128( (__m128i *)chain, c );
+   _mm_storeu_si128( (__m128i *)X, x );
+}
+
+// Decryption has no chaining dependency, so it runs CBC_LANES blocks at a
+// time: each AESDEC takes several cycles to complete but a new one can start
+// every cycle, and independent blocks fill that gap.
+#define CBC_LANES 8
+
+// One round, with round key k, on eight blocks b0..b7.
+#define AESNI_X8(op) { b0 = op( b0, k ); b1 = op( b1, k ); b2 = op( b2, k ); b3 = op( b3, k ); \
+                       b4 = op( b4, k ); b5 = op( b5, k ); b6 = op( b6, k ); b7 = op( b7, k ); }
+
+template <int NR> static void _aesni_cbc_decrypt( const BYTE *in, BYTE *out, size_t blocks, const AES_KEY *ks, const BYTE *iv, BYTE *chain )
+{
+   __m128i prev = _mm_loadu_si128( (const __m128i *)iv );
+   
+   for (; blocks >= CBC_LANES; blocks-=CBC_LANES, in+=CBC_LANES*BLK_SIZE, out+=CBC_LANES*BLK_SIZE) {
+      const __m128i *C = (const __m128i *)in;
+      __m128i c0 = _mm_loadu_si128( C+0 ), c1 = _mm_loadu_si128( C+1 ), c2 = _mm_loadu_si128( C+2 ), 
+              c3 = _mm_loadu_si128( C+3 ), c4 = _mm_loadu_si128( C+4 ), c5 = _mm_loadu_si128( C+5 ),
+              c6 = _mm_loadu_si128( C+6 ), c7 = _mm_loadu_si128( C+7 );
+      
+      __m128i k = _rk( ks, 0 );
+      __m128i b0 = _mm_xor_si128( c0, k ), b1 = _mm_xor_si128( c1, k ), b2 = _mm_xor_si128( c2, k ),
+              b3 = _mm_xor_si128( c3, k ), b4 = _mm_xor_si128( c4, k ), b5 = _mm_xor_si128( c5, k ),
+              b6 = _mm_xor_si128( c6, k ), b7 = _mm_xor_si128( c7, k );
+
+      for (int r=1; r<NR; r++) { k = _rk( ks, r ); AESNI_X8( _mm_aesdec_si128 ); }
+      k = _rk( ks, NR ); AESNI_X8( _mm_aesdeclast_si128 );
+      
+      // All of this group's ciphertext is in registers, so in == out is fine.
+      __m128i *P = (__m128i *)out;
+      _mm_storeu_si128( P+0, _mm_xor_si128( b0, prev )); _mm_storeu_si128( P+1, _mm_xor_si128( b1, c0 ));
+      _mm_storeu_si128( P+2, _mm_xor_si128( b2, c1   )); _mm_storeu_si128( P+3, _mm_xor_si128( b3, c2 ));
+      _mm_storeu_si128( P+4, _mm_xor_si128( b4, c3   )); _mm_storeu_si128( P+5, _mm_xor_si128( b5, c4 ));
+      _mm_storeu_si128( P+6, _mm_xor_si128( b6, c5   )); _mm_storeu_si128( P+7, _mm_xor_si128( b7, c6 ));
+      prev = c7;
+   }
+   
+   for (; blocks; blocks--, in+=BLK_SIZE, out+=BLK_SIZE) {
+      __m128i c = _mm_loadu_si128( (const __m128i *)in );
+      _mm_storeu_si128( (__m128i *)out, _mm_xor_si128( _aesni_dec<NR>( c, ks ), prev ));
+      prev = c;
+   }
+   _mm_storeu_si128( (__m128i *)chain, prev );
+}
+
+static inline UINT _be32( UINT v ) {
+   return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+static inline __m128i _ctrBlock( const _ctr_t &c ) {
+   return _mm_set_epi32( (int)_be32( (UINT)c.lo ), (int)_be32( (UINT)(c.lo >> 32) ),
+                         (int)_be32( (UINT)c.hi ), (int)_be32( (UINT)(c.hi >> 32) ));
+}
+
+// CTR over whole blocks, eight at a time as in CBC decryption.  Advances c.
+template <int NR> static void _aesni_ctr( const BYTE *in, BYTE *out, size_t blocks, const AES_KEY *ks, _ctr_t &c )
+{
+   for (; blocks >= CBC_LANES; blocks-=CBC_LANES, in+=CBC_LANES*BLK_SIZE, out+=CBC_LANES*BLK_SIZE) {
+      __m128i k = _rk( ks, 0 );
+      __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+      
+      if ((UINT)c.lo <= 0xffffffff - CBC_LANES) {
+         // Usual case: no carry out of the low word, so only it changes.
+         __m128i top = _mm_xor_si128( _mm_and_si128( _ctrBlock( c ), _mm_setr_epi32( -1, -1, -1, 0 )), k );
+         UINT    lo  = (UINT)c.lo;
+         #define CTR_LO(i) _mm_xor_si128( top, _mm_slli_si128( _mm_cvtsi32_si128( (int)_be32( lo + i )), 12 ))
+         b0 = CTR_LO( 0 ); b1 = CTR_LO( 1 ); b2 = CTR_LO( 2 ); b3 = CTR_LO( 3 );
+         b4 = CTR_LO( 4 ); b5 = CTR_LO( 5 ); b6 = CTR_LO( 6 ); b7 = CTR_LO( 7 );
+         #undef CTR_LO
+         _ctrAdd( c, CBC_LANES );
+      } else {
+         b0 = _mm_xor_si128( _ctrBlock( c ), k ); _ctrAdd( c, 1 );
+         b1 = _mm_xor_si128( _ctrBlock( c ), k ); _ctrAdd( c, 1 );
+         b2 = _mm_xor_si128( _ctrBlock( c ), k ); _ctrAdd( c, 1 );
+         b3 = _mm_xor_si128( _ctrBlock( c ), k ); _ctrAdd( c, 1 );
+         b4 = _mm_xor_si128( _ctrBlock( c ), k ); _ctrAdd( c, 1 );
+         b5 = _mm_xor_si128( _ctrBlock( c ), k ); _ctrAdd( c, 1 );
+         b6 = _mm_xor_si128( _ctrBlock( c ), k ); _ctrAdd( c, 1 );
+         b7 = _mm_xor_si128( _ctrBlock( c ), k ); _ctrAdd( c, 1 );
+      }
+
+      for (int r=1; r<NR; r++) { k = _rk( ks, r ); AESNI_X8( _mm_aesenc_si128 ); }
+      k = _rk( ks, NR ); AESNI_X8( _mm_aesenclast_si128 );
+
+      const __m128i *I = (const __m128i *)in;
+      __m128i       *O = (__m128i *)out;
+      _mm_storeu_si128( O+0, _mm_xor_si128( b0, _mm_loadu_si128( I+0 ))); _mm_storeu_si128( O+1, _mm_xor_si128( b1, _mm_loadu_si128( I+1 )));
+      _mm_storeu_si128( O+2, _mm_xor_si128( b2, _mm_loadu_si128( I+2 ))); _mm_storeu_si128( O+3, _mm_xor_si128( b3, _mm_loadu_si128( I+3 )));
+      _mm_storeu_si128( O+4, _mm_xor_si128( b4, _mm_loadu_si128( I+4 ))); _mm_storeu_si128( O+5, _mm_xor_si128( b5, _mm_loadu_si128( I+5 )));
+      _mm_storeu_si128( O+6, _mm_xor_si128( b6, _mm_loadu_si128( I+6 ))); _mm_storeu_si128( O+7, _mm_xor_si128( b7, _mm_loadu_si128( I+7 )));
+   }
+   
+   for (; blocks; blocks--, in+=BLK_SIZE, out+=BLK_SIZE) {
+      __m128i b = _aesni_enc<NR>( _ctrBlock( c ), ks ); _ctrAdd( c, 1 );
+      _mm_storeu_si128( (__m128i *)out, _mm_xor_si128( b, _mm_loadu_si128( (const __m128i *)in )));
+   }
+}
+
+#endif // JHB_AESNI
+
+// --- Bitsliced (SSE2) -------------------------------------------------------
+//
+// Constant-time AES for CPUs without AES-NI: eight blocks at once, with no
+// table lookups and no data-dependent branches or addresses.  (After Kasper
+// and Schwabe, "Faster and Timing-Attack Resistant AES-GCM", with the
+// Boyar-Peralta S-box circuit.)
+//
+// Layout: plane i holds bit i of every state byte.  Byte j of a plane is
+// state byte j (row j%4, column j/4), and bit k of that byte belongs to block
+// k.  ShiftRows is then a byte permutation of each plane, and the row
+// rotations of MixColumns are byte rotations within 32-bit lanes; both are
+// a few SSE2 shifts and masks.
+//
+// Round keys come from an OpenSSL-format AES_KEY (the table code's layout):
+// the encryption schedule for encryption and, as in AES_decrypt, the
+// "equivalent inverse cipher" schedule for decryption.
+
+#ifdef JHB_X86
+
+static bool _sse2() { return 0 != (CpuFeatures() & CPU_SSE2); }
+
+// __m128i with operators, so the S-box circuit reads as plain boolean algebra.
+struct _bs {
+   __m128i v;
+   _bs() {}
+   _bs( __m128i x ) : v( x ) {}
+};
+static inline _bs operator^( _bs a, _bs b ) { return _mm_xor_si128( a.v, b.v ); }
+static inline _bs operator&( _bs a, _bs b ) { return _mm_and_si128( a.v, b.v ); }
+
+// The S-box's non-linear middle, shared by _bs_sbox and _bs_invSbox: from the
+// top linear transform's outputs (y1..y21 and x7) to the inputs of the 
+// bottom one (z0..z17), by inversion in GF(2^4)^2.
+#define BS_SBOX_MIDDLE                                                        \
+   _bs t2  = y12 & y15, t3  = y3  & y6 , t4  = t3  ^ t2 , t5  = y4  & x7 ;    \
+   _bs t6  = t5  ^ t2 , t7  = y13 & y16, t8  = y5  & y1 , t9  = t8  ^ t7 ;    \
+   _bs t10 = y2  & y7 , t11 = t10 ^ t7 , t12 = y9  & y11, t13 = y14 & y17;    \
+   _bs t14 = t13 ^ t12, t15 = y8  & y10, t16 = t15 ^ t12, t17 = t4  ^ t14;    \
+   _bs t18 = t6  ^ t16, t19 = t9  ^ t14, t20 = t11 ^ t16, t21 = t17 ^ y20;    \
+   _bs t22 = t18 ^ y19, t23 = t19 ^ y21, t24 = t20 ^ y18;                     \
+   _bs t25 = t21 ^ t22, t26 = t21 & t23, t27 = t24 ^ t26, t28 = t25 & t27;    \
+   _bs t29 = t28 ^ t22, t30 = t23 ^ t24, t31 = t22 ^ t26, t32 = t31 & t30;    \
+   _bs t33 = t32 ^ t24, t34 = t23 ^ t33, t35 = t27 ^ t33, t36 = t24 & t35;    \
+   _bs t37 = t36 ^ t34, t38 = t27 ^ t36, t39 = t29 & t38, t40 = t25 ^ t39;    \
+   _bs t41 = t40 ^ t37, t42 = t29 ^ t33, t43 = t29 ^ t40, t44 = t33 ^ t37;    \
+   _bs t45 = t42 ^ t41;                                                       \
+   _bs z0  = t44 & y15, z1  = t37 & y6 , z2  = t33 & x7 , z3  = t43 & y16;    \
+   _bs z4  = t40 & y1 , z5  = t29 & y7 , z6  = t42 & y11, z7  = t45 & y17;    \
+   _bs z8  = t41 & y10, z9  = t44 & y12, z10 = t37 & y3 , z11 = t33 & y4 ;    \
+   _bs z12 = t43 & y13, z13 = t40 & y5 , z14 = t29 & y2 , z15 = t42 & y9 ;    \
+   _bs z16 = t45 & y14, z17 = t41 & y8 ;
+
+// SubBytes on all eight planes (q[0] = least significant bit), except for
+// the affine constant 0x63: that survives ShiftRows and MixColumns unchanged,
+// so _bs_keys() folds it into the round keys instead.
+static void _bs_sbox( _bs q[8] )
+{
+   _bs x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4], x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+
+   // Top linear transform.
+   _bs y14 = x3  ^ x5 , y13 = x0  ^ x6 , y9  = x0  ^ x3 , y8  = x0  ^ x5 ;
+   _bs t0  = x1  ^ x2 , y1  = t0  ^ x7 , y4  = y1  ^ x3 , y12 = y13 ^ y14;
+   _bs y2  = y1  ^ x0 , y5  = y1  ^ x6 , y3  = y5  ^ y8 , t1  = x4  ^ y12;
+   _bs y15 = t1  ^ x5 , y20 = t1  ^ x1 , y6  = y15 ^ x7 , y10 = y15 ^ t0 ;
+   _bs y11 = y20 ^ y9 , y7  = x7  ^ y11, y17 = y10 ^ y11, y19 = y10 ^ y8 ;
+   _bs y16 = t0  ^ y11, y21 = y13 ^ y16, y18 = x0  ^ y16;
+
+   BS_SBOX_MIDDLE
+
+   // Bottom linear transform.
+   _bs t46 = z15 ^ z16, t47 = z10 ^ z11, t48 = z5  ^ z13, t49 = z9  ^ z10;
+   _bs t50 = z2  ^ z12, t51 = z2  ^ z5 , t52 = z7  ^ z8 , t53 = z0  ^ z3 ;
+   _bs t54 = z6  ^ z7 , t55 = z16 ^ z17, t56 = z12 ^ t48, t57 = t50 ^ t53;
+   _bs t58 = z4  ^ t46, t59 = z3  ^ t54, t60 = t46 ^ t57, t61 = z14 ^ t57;
+   _bs t62 = t52 ^ t58, t63 = t49 ^ t58, t64 = z4  ^ t59, t65 = t61 ^ t62;
+   _bs t66 = z1  ^ t63;
+   _bs s0  = t59 ^ t63, s6  = t56 ^ t62, s7  = t48 ^ t60, t67 = t64 ^ t65;
+   _bs s3  = t53 ^ t66, s4  = t51 ^ t66, s5  = t47 ^ t65, s1  = t64 ^ s3 ;
+   _bs s2  = t55 ^ t67;
+
+   q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3; q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+// InvSubBytes.  S(x) = A(inv(x)) ^ 0x63 and inversion is its own inverse, so
+// InvS(x) = B(S(B(x ^ 0x63)) ^ 0x63), where B undoes A's linear part.  The
+// two inner 0x63s cancel, and the first is folded into the previous round
+// key.  B is folded into the S-box's two linear transforms: 23 and 35 xors
+// here against 39 and 46 for B, the forward transform and B again.
+static void _bs_invSbox( _bs q[8] )
+{
+   _bs q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3], q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+
+   // Top linear transform, after B.
+   _bs y3  = q4  ^ q7 , y5  = q4  ^ q6 , y6  = q6  ^ y3 , y8  = q4  ^ y6 ;
+   _bs y9  = q3  ^ q4 , y1  = q0  ^ y9 , y10 = y6  ^ y1 , y13 = q1  ^ y1 ;
+   _bs y2  = y5  ^ y13, y4  = y9  ^ y2 , y7  = q5  ^ y4 , y12 = y3  ^ y4 ;
+   _bs y14 = q3  ^ y6 , y16 = y1  ^ y7 , y18 = q5  ^ y9 , y19 = q0  ^ q3 ;
+   _bs y21 = q1  ^ y7 , u0  = q2  ^ q7 , y11 = y4  ^ u0 , y17 = y10 ^ y11;
+   _bs y15 = y16 ^ y17, y20 = y9  ^ y11, x7  = q5  ^ u0 ;
+
+   BS_SBOX_MIDDLE
+
+   // Bottom linear transform, then B.
+   _bs v0  = z6  ^ z15, v1  = z13 ^ v0 , v2  = z12 ^ v1 , v3  = z16 ^ v2 ;
+   _bs v4  = z3  ^ z4 , v5  = z8  ^ v3 , v6  = z2  ^ z10, v7  = z1  ^ v4 ;
+   _bs v8  = z4  ^ z5 , v9  = z9  ^ z17, v10 = z8  ^ v6 , v11 = z14 ^ v10;
+   _bs v12 = z0  ^ v5 , v13 = v7  ^ v11, v14 = z11 ^ v13, v15 = z16 ^ v0 ;
+   _bs v16 = z1  ^ v8 , v17 = z0  ^ v8 , v18 = z17 ^ v2 , v19 = v1  ^ v9 ;
+   _bs v20 = z12 ^ v15, v21 = z3  ^ v5 , v22 = z15 ^ v9 , v23 = v6  ^ v18;
+   _bs v24 = z7  ^ z11, v25 = z7  ^ v3 , v26 = v23 ^ v24, r6  = v13 ^ v19;
+   _bs r7  = z5  ^ v21, r2  = v12 ^ v16, r4  = z2  ^ v12, r0  = z11 ^ v22;
+   _bs r1  = v4  ^ v25, r5  = v14 ^ v20, r3  = v17 ^ v26;
+
+   q[0] = r0; q[1] = r1; q[2] = r2; q[3] = r3; q[4] = r4; q[5] = r5; q[6] = r6; q[7] = r7;
+}
+
+// Swaps the bits of b under mask m with the bits of a under (m << n).  Three
+// rounds of it transpose the 8x8 bit matrix in each byte position.
+#define BS_SWAPMOVE(a,b,n,m) {                                               \
+      __m128i t = _mm_and_si128( _mm_xor_si128( _mm_srli_epi64( a.v, n ), b.v ), m ); \
+      b.v = _mm_xor_si128( b.v, t );                                         \
+      a.v = _mm_xor_si128( a.v, _mm_slli_epi64( t, n ));                     \
+   }
+
+// Eight blocks <-> eight bit planes.  (Its own inverse.)
+static void _bs_ortho( _bs q[8] )
+{
+   const __m128i m1 = _mm_set1_epi8( 0x55 ), m2 = _mm_set1_epi8( 0x33 ), m4 = _mm_set1_epi8( 0x0f );
+   BS_SWAPMOVE( q[0], q[1], 1, m1 ); BS_SWAPMOVE( q[2], q[3], 1, m1 );
+   BS_SWAPMOVE( q[4], q[5], 1, m1 ); BS_SWAPMOVE( q[6], q[7], 1, m1 );
+   BS_SWAPMOVE( q[0], q[2], 2, m2 ); BS_SWAPMOVE( q[1], q[3], 2, m2 );
+   BS_SWAPMOVE( q[4], q[6], 2, m2 ); BS_SWAPMOVE( q[5], q[7], 2, m2 );
+   BS_SWAPMOVE( q[0], q[4], 4, m4 ); BS_SWAPMOVE( q[1], q[5], 4, m4 );
+   BS_SWAPMOVE( q[2], q[6], 4, m4 ); BS_SWAPMOVE( q[3], q[7], 4, m4 );
+}
+
+// The byte permutations: ShiftRows and its inverse, and the row rotations
+// of MixColumns.  Row r of a column is byte r of a 32-bit lane.  SSE2 does 
+// them with lane shuffles, shifts and masks; SSSE3 with one pshufb each.
+
+struct _bsSse2 {
+   static __m128i row( int r ) { return _mm_set1_epi32( 0xff << (8*r) ); }
+
+   // Row r rotates left r columns: a lane rotation under the row's mask.
+   static inline _bs shiftRows( _bs x ) {
+      __m128i v = x.v;
+      return _mm_or_si128( _mm_or_si128( 
+                _mm_and_si128( v,                             row( 0 )),
+                _mm_and_si128( _mm_shuffle_epi32( v, 0x39 ), row( 1 ))),
+             _mm_or_si128( 
+                _mm_and_si128( _mm_shuffle_epi32( v, 0x4e ), row( 2 )),
+                _mm_and_si128( _mm_shuffle_epi32( v, 0x93 ), row( 3 ))));
+   }
+   static inline _bs invShiftRows( _bs x ) {
+      __m128i v = x.v;
+      return _mm_or_si128( _mm_or_si128( 
+                _mm_and_si128( v,                             row( 0 )),
+                _mm_and_si128( _mm_shuffle_epi32( v, 0x93 ), row( 1 ))),
+             _mm_or_si128( 
+                _mm_and_si128( _mm_shuffle_epi32( v, 0x4e ), row( 2 )),
+                _mm_and_si128( _mm_shuffle_epi32( v, 0x39 ), row( 3 ))));
+   }
+
+   // Row r takes row r+1 (r+2) of the same column.
+   static inline _bs rot8 ( _bs x ) { return _mm_or_si128( _mm_srli_epi32( x.v,  8 ), _mm_slli_epi32( x.v, 24 )); }
+   static inline _bs rot16( _bs x ) { return _mm_shufflehi_epi16( _mm_shufflelo_epi16( x.v, 0xb1 ), 0xb1 ); }
+};
+
+#ifdef JHB_SSSE3
+struct _bsSsse3 {
+   static inline _bs shiftRows   ( _bs x ) { return _mm_shuffle_epi8( x.v, _mm_setr_epi8( 0, 5,10,15, 4, 9,14, 3, 8,13, 2, 7,12, 1, 6,11 )); }
+   static inline _bs invShiftRows( _bs x ) { return _mm_shuffle_epi8( x.v, _mm_setr_epi8( 0,13,10, 7, 4, 1,14,11, 8, 5, 2,15,12, 9, 6, 3 )); }
+   static inline _bs rot8        ( _bs x ) { return _mm_shuffle_epi8( x.v, _mm_setr_epi8( 1, 2, 3, 0, 5, 6, 7, 4, 9,10,11, 8,13,14,15,12 )); }
+   static inline _bs rot16       ( _bs x ) { return _mm_shuffle_epi8( x.v, _mm_setr_epi8( 2, 3, 0, 1, 6, 7, 4, 5,10,11, 8, 9,14,15,12,13 )); }
+};
+#endif
+
+// Multiply every byte by x (02) in GF(2^8): a plane shift, with the carry 
+// folded back in by the 0x1b polynomial.
+static inline void _bs_xtime( _bs q[8] ) {
+   _bs hi = q[7];
+   q[7] = q[6]; q[6] = q[5]; q[5] = q[4]; q[4] = q[3] ^ hi;
+   q[3] = q[2] ^ hi; q[2] = q[1]; q[1] = q[0] ^ hi; q[0] = hi;
+}
+
+// MixColumns, then AddRoundKey: out_r = 02.(a_r ^ a_r+1) ^ a_r+1 ^ a_r+2 ^
+// a_r+3 ^ k_r.  The 02.t term is _bs_xtime() unrolled into the xors.
+template <class P> static void _bs_mixColumns( _bs q[8], const _bs k[8] ) {
+   _bs t[8];
+   for (int i=0; i<8; i++) {
+      _bs a1 = P::rot8( q[i] ); 
+      t[i] = q[i] ^ a1; 
+      q[i] = a1 ^ P::rot16( t[i] ) ^ k[i];
+   }
+   q[0] = q[0] ^ t[7];         q[1] = q[1] ^ t[0] ^ t[7];  q[2] = q[2] ^ t[1];         q[3] = q[3] ^ t[2] ^ t[7];
+   q[4] = q[4] ^ t[3] ^ t[7];  q[5] = q[5] ^ t[4];         q[6] = q[6] ^ t[5];         q[7] = q[7] ^ t[6];
+}
+
+// InvMixColumns = MixColumns after a_r ^= 04.(a_r ^ a_r+2).
+template <class P> static void _bs_invMixColumns( _bs q[8], const _bs k[8] ) {
+   _bs u[8];
+   for (int i=0; i<8; i++) { u[i] = q[i] ^ P::rot16( q[i] ); }
+   _bs_xtime( u ); _bs_xtime( u );
+   for (int i=0; i<8; i++) { q[i] = q[i] ^ u[i]; }
+   _bs_mixColumns<P>( q, k );
+}
+
+// Round keys as planes: each key byte is the same for all eight blocks, so
+// its bits become 0x00/0xff bytes.  The S-box constant 0x63 goes into every
+// key after an encryption S-box, and every key before a decryption one.
+static void _bs_keys( const AES_KEY *ks, _bs rk[][8], bool bEncrypt )
+{
+   for (int r=0; r<=ks->rounds; r++) {
+      BYTE k[BLK_SIZE];
+      for (int c=0; c<4; c++) {
+         UINT w = ks->rd_key[4*r + c];
+         k[4*c] = (BYTE)(w >> 24); k[4*c+1] = (BYTE)(w >> 16); k[4*c+2] = (BYTE)(w >> 8); k[4*c+3] = (BYTE)w;
+      }
+      __m128i v = _mm_loadu_si128( (const __m128i *)k );
+      if (bEncrypt ? (r > 0) : (r < ks->rounds)) { v = _mm_xor_si128( v, _mm_set1_epi8( 0x63 )); }
+      for (int i=0; i<8; i++) {
+         __m128i bit = _mm_set1_epi8( (char)(1 << i) );
+         rk[r][i] = _mm_cmpeq_epi8( _mm_and_si128( v, bit ), bit );
+      }
+      SecureZero( k, sizeof k );
+   }
+}
+
+static inline void _bs_addRoundKey( _bs q[8], const _bs k[8] ) {
+   for (int i=0; i<8; i++) { q[i] = q[i] ^ k[i]; }
+}
+
+// Eight blocks, 128 bytes, in to out (which may be the same).
+template <class P> 
+static void _bs_crypt8( const BYTE *in, BYTE *out, const _bs rk[][8], int nr, bool bEncrypt )
+{
+   _bs q[8];
+   for (int i=0; i<8; i++) { q[i] = _mm_loadu_si128( (const __m128i *)in + i ); }
+   _bs_ortho( q );
+
+   _bs_addRoundKey( q, rk[0] );
+   for (int r=1; r<nr; r++) {
+      if (bEncrypt) {
+         _bs_sbox( q );
+         for (int i=0; i<8; i++) { q[i] = P::shiftRows( q[i] ); }
+         _bs_mixColumns<P>( q, rk[r] );
+      } else {
+         _bs_invSbox( q );
+         for (int i=0; i<8; i++) { q[i] = P::invShiftRows( q[i] ); }
+         _bs_invMixColumns<P>( q, rk[r] );
+      }
+   }
+   if (bEncrypt) {
+      _bs_sbox( q );
+      for (int i=0; i<8; i++) { q[i] = P::shiftRows( q[i] ) ^ rk[nr][i]; }
+   } else {
+      _bs_invSbox( q );
+      for (int i=0; i<8; i++) { q[i] = P::invShiftRows( q[i] ) ^ rk[nr][i]; }
+   }
+
+   _bs_ortho( q );
+   for (int i=0; i<8; i++) { _mm_storeu_si128( (__m128i *)out + i, q[i].v ); }
+}
+
+typedef void (*_bs_crypt8_f)( const BYTE *in, BYTE *out, const _bs rk[][8], int nr, bool bEncrypt );
+
+static _bs_crypt8_f _bs_pick()
+{
+#ifdef JHB_SSSE3
+   if (CpuFeatures() & CPU_SSSE3) { return _bs_crypt8<_bsSsse3>; }
+#endif
+   return _bs_crypt8<_bsSse2>;
+}
+
+#define BS_BLOCKS 8
+
+// ECB over whole blocks.  A short last group is padded.
+static void _bs_ecb( const BYTE *in, BYTE *out, size_t blocks, const AES_KEY *ks, bool bEncrypt )
+{
+   _bs rk[AES_MAXNR+1][8];
+   _bs_keys( ks, rk, bEncrypt );
+   _bs_crypt8_f crypt8 = _bs_pick();
+
+   for (; blocks >= BS_BLOCKS; blocks-=BS_BLOCKS, in+=BS_BLOCKS*BLK_SIZE, out+=BS_BLOCKS*BLK_SIZE) {
+      crypt8( in, out, rk, ks->rounds, bEncrypt );
+   }
+   if (blocks) {
+      BYTE tmp[BS_BLOCKS*BLK_SIZE]; memset( tmp, 0, sizeof tmp );
+      memcpy( tmp, in, blocks*BLK_SIZE );
+      crypt8( tmp, tmp, rk, ks->rounds, bEncrypt );
+      memcpy( out, tmp, blocks*BLK_SIZE );
+      SecureZero( tmp, sizeof tmp );
+   }
+   SecureZero( rk, sizeof rk );
+}
+
+// CBC decryption over whole blocks.  in may equal out, so each group's 
+// ciphertext is kept for the chaining xor.
+static void _bs_cbc_decrypt( const BYTE *in, BYTE *out, size_t blocks, const AES_KEY *ks, const BYTE *iv, BYTE *chain )
+{
+   _bs rk[AES_MAXNR+1][8];
+   _bs_keys( ks, rk, false );
+   _bs_crypt8_f crypt8 = _bs_pick();
+
+   __m128i ct[BS_BLOCKS+1], pt[BS_BLOCKS];      // ct[0] is the previous ciphertext
+   ct[0] = _mm_loadu_si128( (const __m128i *)iv );
+   
+   while (blocks) {
+      size_t n = min( blocks, (size_t)BS_BLOCKS );
+      if (n < BS_BLOCKS) { memset( ct + 1 + n, 0, (BS_BLOCKS-n)*BLK_SIZE ); }
+      memcpy( ct + 1, in, n*BLK_SIZE );
+      crypt8( (const BYTE *)(ct + 1), (BYTE *)pt, rk, ks->rounds, false );
+
+      for (size_t i=0; i<n; i++) { 
+         _mm_storeu_si128( (__m128i *)out + i, _mm_xor_si128( pt[i], ct[i] ));
+      }
+      ct[0] = ct[n];
+      
+      blocks -= n; in += n*BLK_SIZE; out += n*BLK_SIZE;
+   }
+   _mm_storeu_si128( (__m128i *)chain, ct[0] );
+
+   SecureZero( rk, sizeof rk ); SecureZero( pt, sizeof pt );
+}
+
+#endif // JHB_X86
+
+// --- Public (internal) interface --------------------------------------------
+
+int aes_set_encrypt_key( const BYTE *key, int bits, AES_KEY *ks ) {
+#ifdef JHB_AESNI
+   if (_aesni()) { return _aesni_set_encrypt_key( key, bits, ks ); }
+#endif
+   return private_AES_set_encrypt_key( key, bits, ks );
+}
+
+int aes_set_decrypt_key( const BYTE *key, int bits, AES_KEY *ks ) {
+#ifdef JHB_AESNI
+   if (_aesni()) { return _aesni_set_decrypt_key( key, bits, ks ); }
+#endif
+   return private_AES_set_decrypt_key( key, bits, ks );
+}
+
+void aes_encrypt( const BYTE *in, BYTE *out, const AES_KEY *ks ) {
+#ifdef JHB_AESNI
+   if (_aesni()) { AESNI_NR( ks, _aesni_ecb, ( in, out, 1, ks )); return; }
+#endif
+   AES_encrypt( in, out, ks );
+}
+
+void aes_decrypt( const BYTE *in, BYTE *out, const AES_KEY *ks ) {
+#ifdef JHB_AESNI
+   if (_aesni()) { AESNI_NR( ks, _aesni_decrypt, ( in, out, ks )); return; }
+#endif
+   AES_decrypt( in, out, ks );
+}
+
+// Whole blocks go through the AES-NI loops or, for decryption without AES-NI,
+// the bitsliced code.  Anything else (encryption without AES-NI, a partial 
+// last block, non-x86) goes through OpenSSL's CBC code and the block 
+// functions above.
+//
+// The bitsliced decryption is constant-time, where the tables leak through
+// the cache, but it is a little slower (about 3% with SSSE3, 25% with plain
+// SSE2).  Builds that would rather have the speed can define 
+// JHB_TABLE_CBC_DECRYPT.
+void aes_cbc_encrypt( const BYTE *in, BYTE *out, size_t len, const AES_KEY *ks, const BYTE *iv, bool bEncrypt )
+{
+   BYTE chain[BLK_SIZE];
+   memcpy( chain, iv, BLK_SIZE );
+   
+   size_t whole = len - (len % BLK_SIZE);
+#ifdef JHB_AESNI
+   if (_aesni()) {
+      if (bEncrypt) { AESNI_NR( ks, _aesni_cbc_encrypt, ( in, out, whole / BLK_SIZE, ks, iv, chain )); }
+      else          { AESNI_NR( ks, _aesni_cbc_decrypt, ( in, out, whole / BLK_SIZE, ks, iv, chain )); }
+      in += whole; out += whole; len -= whole;
+   }
+#endif
+#if defined(JHB_X86) && !defined(JHB_TABLE_CBC_DECRYPT)
+   if (!bEncrypt && len >= BLK_SIZE && _sse2()) {
+      _bs_cbc_decrypt( in, out, whole / BLK_SIZE, ks, iv, chain );
+      in += whole; out += whole; len -= whole;
+   }
+#endif
+   if (0 != len) {
+      bEncrypt ? CRYPTO_cbc128_encrypt( in, out, len, ks, chain, (block128_f)aes_encrypt )
+               : CRYPTO_cbc128_decrypt( in, out, len, ks, chain, (block128_f)aes_decrypt );
+   }
+}
+
+// ECB encryption of whole blocks.  Without AES-NI this is the bitsliced 
+// code, so it is constant-time; callers that only need one block (CMAC 
+// subkeys) use it for that reason.
+void aes_ecb_encrypt( const BYTE *in, BYTE *out, size_t blocks, const AES_KEY *ks )
+{
+#ifdef JHB_AESNI
+   if (_aesni()) { AESNI_NR( ks, _aesni_ecb, ( in, out, blocks, ks )); return; }
+#endif
+#ifdef JHB_X86
+   if (_sse2()) { _bs_ecb( in, out, blocks, ks, true ); return; }
+#endif
+   for (; blocks; blocks--, in+=BLK_SIZE, out+=BLK_SIZE) { AES_encrypt( in, out, ks ); }
+}
+
+// CBC-MAC chaining over whole blocks: X = E( X ^ M_i ) for each block in turn.
+// (CMAC's inner loop.)  Without AES-NI this is the tables, as single-block 
+// encryption is.
+void aes_cbc_mac( const BYTE *in, size_t blocks, const AES_KEY *ks, BYTE *X )
+{
+#ifdef JHB_AESNI
+   if (_aesni()) { AESNI_NR( ks, _aesni_cbc_mac, ( in, blocks, ks, X )); return; }
+#endif
+   for (; blocks; blocks--, in+=BLK_SIZE) {
+      for (int i=0; i<BLK_SIZE; i++) { X[i] ^= in[i]; }
+      AES_encrypt( X, X, ks );
+   }
+}
+
+// CBC encryption of whole blocks fused with a CBC-MAC of the ciphertext; see
+// _aesni_cbc_encrypt_mac() for X.  The AES-NI loop handles one key size, so ks
+// and mks must match in that.  Otherwise it is the tables, block by block; 
+// each block is still MAC'd while it is in L1.
+void aes_cbc_encrypt_mac( const BYTE *in, BYTE *out, size_t blocks, const AES_KEY *ks, BYTE *chain, const AES_KEY *mks, BYTE *X )
+{
+#ifdef JHB_AESNI
+   if (_aesni() && (ks->rounds == mks->rounds)) { 
+      AESNI_NR( ks, _aesni_cbc_encrypt_mac, ( in, out, blocks, ks, chain, mks, X )); 
+      return; 
+   }
+#endif
+   for (; blocks; blocks--, in+=BLK_SIZE, out+=BLK_SIZE) {
+      for (int i=0; i<BLK_SIZE; i++) { chain[i] ^= in[i]; }
+      aes_encrypt( chain, chain, ks  );
+      aes_encrypt( X    , X    , mks );
+      for (int i=0; i<BLK_SIZE; i++) { out[i] = chain[i]; X[i] ^= chain[i]; }
+   }
+}
+
+// CTR (SP 800-38A) from keystream block 'block' on: block i of the stream is 
+// E( ctr + i ), the whole counter block incremented as one big-endian number
+// (as in OpenSSL's ctr128.c).  Every block is independent of the others, so 
+// callers can split one stream into ranges and run them separately; only the
+// last range may end in a partial block.
+#define CTR_CHUNK 32    // blocks of keystream per aes_ecb_encrypt() call
+
+void aes_ctr_encrypt( const BYTE *in, BYTE *out, size_t len, const AES_KEY *ks, const BYTE *ctr, unsigned __int64 block )
+{
+   _ctr_t c = { _ld64( ctr ), _ld64( ctr + 8 ) };
+   _ctrAdd( c, block );
+
+#ifdef JHB_AESNI
+   if (_aesni()) {
+      size_t blocks = len / BLK_SIZE;
+      AESNI_NR( ks, _aesni_ctr, ( in, out, blocks, ks, c ));
+      in += blocks * BLK_SIZE; out += blocks * BLK_SIZE; len -= blocks * BLK_SIZE;
+   }
+#endif
+
+   // Everything else: a chunk of counter blocks through the ECB code, which 
+   // is the constant-time bitsliced code where there is SSE2.
+   BYTE ks_[CTR_CHUNK * BLK_SIZE];
+   while (0 != len) {
+      size_t n = min( len, sizeof ks_ );
+      size_t blocks = (n + BLK_SIZE - 1) / BLK_SIZE;
+      for (size_t i=0; i<blocks; i++) {
+         _st64( c.hi, &ks_[i*BLK_SIZE] ); _st64( c.lo, &ks_[i*BLK_SIZE + 8] );
+         _ctrAdd( c, 1 );
+      }
+      aes_ecb_encrypt( ks_, ks_, blocks, ks );
+      for (size_t i=0; i<n; i++) { out[i] = in[i] ^ ks_[i]; }
+      in += n; out += n; len -= n;
+   }
+   SecureZero( ks_, sizeof ks_ );
+}
+
+// --- AesKeyT ----------------------------------------------------------------
+
+enum { KS_ENC, KS_DEC, KS_COUNT };
+
+_aes_key_t::_aes_key_t( const BYTE *key, int bits ) : _ks( KS_COUNT * sizeof(AES_KEY) ) {
+   aes_set_encrypt_key( key, bits, (AES_KEY *)_ks.ptr() + KS_ENC );
+   aes_set_decrypt_key( key, bits, (AES_KEY *)_ks.ptr() + KS_DEC );
+}
+
+const AES_KEY *aes_schedule( const _aes_key_t &key, bool bEncrypt ) {
+   return (const AES_KEY *)key._ks.ptr() + (bEncrypt ? KS_ENC : KS_DEC);
+}
+
+// ----------------------------------------------------------------------------
+
+bool aes_TEST() {
+
+   BYTE key[32], in[64], out[64], ref[64], iv[BLK_SIZE];
+   AES_KEY ks;
+
+   {// FIPS 197 Appendix C: AES-128, -192, -256 single blocks.
+      static const char *ct[] = { "69c4e0d86a7b0430d8cdb78070b4c55a",
+                                  "dda97ca4864cdfe06eaf70a0ec0d7191",
+                                  "8ea2b7ca516745bfeafc49904b496089" };
+      CvtHex( "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", key );
+      CvtHex( "00112233445566778899aabbccddeeff", in );
+      for (int i=0; i<NELEM(ct); i++) {
+         int bits = 128 + 64*i;
+         CvtHex( ct[i], ref );
+         aes_set_encrypt_key( key, bits, &ks ); aes_encrypt( in, out, &ks );
+         if (0 != memcmp( out, ref, BLK_SIZE )) { return false; }
+         aes_set_decrypt_key( key, bits, &ks ); aes_decrypt( out, out, &ks );
+         if (0 != memcmp( out, in, BLK_SIZE )) { return false; }
+      }
+   }
+
+   {// SP 800-38A F.2.1/F.2.2: CBC-AES128, both directions, then in place.
+      CvtHex( "2b7e151628aed2a6abf7158809cf4f3c", key );
+      CvtHex( "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+              "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710", in );
+      CvtHex( "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+              "73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7", ref );
+
+      CvtHex( "000102030405060708090a0b0c0d0e0f", iv );
+      aes_set_encrypt_key( key, 128, &ks ); aes_cbc_encrypt( in, out, 64, &ks, iv, true );
+      if (0 != memcmp( out, ref, 64 )) { return false; }
+
+      aes_set_decrypt_key( key, 128, &ks ); aes_cbc_encrypt( out, out, 64, &ks, iv, false );
+      if (0 != memcmp( out, in, 64 )) { return false; }
+   }
+
+   {// Long enough for the multi-block decrypt path, and its leftovers; in place 
+    // and not.
+      const int cb = 37 * BLK_SIZE;
+      MemBuf pt( cb ), ct( cb ), dt( cb );
+      for (int i=0; i<cb; i++) { pt[i] = (BYTE)(i*29 + 3); }
+      memset( iv, 0xa5, BLK_SIZE );
+      
+      AES_KEY ks2; 
+      private_AES_set_encrypt_key( key, 128, &ks2 ); AES_cbc_encrypt( pt, ct, cb, &ks2, iv, AES_ENCRYPT );
+      
+      aes_set_decrypt_key( key, 128, &ks ); 
+      aes_cbc_encrypt( ct, dt, cb, &ks, iv, false );
+      if (0 != memcmp( dt, pt, cb )) { return false; }
+      aes_cbc_encrypt( ct, ct, cb, &ks, iv, false );
+      if (0 != memcmp( ct, pt, cb )) { return false; }
+   }
+   
+   {// AesKey form against the raw-key form, both directions, several messages.
+      AesKey ak( key );
+      BYTE ct1[64], ct2[64], pt[64];
+      for (int len=16; len<=64; len+=16) {
+         memset( iv, len, BLK_SIZE );
+         aes( in, ct1, len, key, iv, true );
+         aes( in, ct2, len, ak , iv, true );
+         if (0 != memcmp( ct1, ct2, len )) { return false; }
+         aes( ct2, pt, len, ak, iv, false );
+         if (0 != memcmp( pt, in, len )) { return false; }
+      }
+   }
+   
+   {// SP 800-38A F.2.3/F.2.5: CBC-AES192 and -256 through aes<>(), raw key and 
+    // AesKeyT, both directions.  F.5.5: CTR-AES256.  (in still holds the F.2 
+    // plaintext.)
+      BYTE k192[24], k256[32], ct[64], pt[64];
+      CvtHex( "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b", k192 );
+      CvtHex( "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4", k256 );
+      CvtHex( "000102030405060708090a0b0c0d0e0f", iv );
+
+      CvtHex( "4f021db243bc633d7178183a9fa071e8b4d9ada9ad7dedf4e5e738763f69145a"
+              "571b242012fb7ae07fa9baac3df102e008b0e27988598881d920a9e64f5615cd", ref );
+      Aes192Key ak192( k192 );
+      aes<Aes192>( in, ct, 64, k192, iv, true );
+      if (0 != memcmp( ct, ref, 64 )) { return false; }
+      aes( ct, pt, 64, ak192, iv, false );
+      if (0 != memcmp( pt, in, 64 )) { return false; }
+
+      CvtHex( "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d"
+              "39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b", ref );
+      Aes256Key ak256( k256 );
+      aes( in, ct, 64, ak256, iv, true );
+      if (0 != memcmp( ct, ref, 64 )) { return false; }
+      aes<Aes256>( ct, pt, 64, k256, iv, false );
+      if (0 != memcmp( pt, in, 64 )) { return false; }
+
+      CvtHex( "601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c5"
+              "2b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6", ref );
+      CvtHex( "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", iv );
+      aes_ctr<Aes256>( in, ct, 64, k256, iv, 1 );
+      if (0 != memcmp( ct, ref, 64 )) { return false; }
+      aes_ctr( ct, pt, 64, ak256, iv, 1 );
+      if (0 != memcmp( pt, in, 64 )) { return false; }
+   }
+   
+   {// SP 800-38A F.5.1/F.5.2: CTR-AES128.  (in still holds the F.2 plaintext.)
+      CvtHex( "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+              "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee", ref );
+      CvtHex( "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", iv );
+      aes_set_encrypt_key( key, 128, &ks ); 
+      aes_ctr_encrypt( in, out, 64, &ks, iv, 0 );
+      if (0 != memcmp( out, ref, 64 )) { return false; }
+      aes_ctr_encrypt( out, out, 64, &ks, iv, 0 );
+      if (0 != memcmp( out, in, 64 )) { return false; }
+      
+      // Starting part way through the stream.
+      aes_ctr_encrypt( in + 32, out, 32, &ks, iv, 2 );
+      if (0 != memcmp( out, ref + 32, 32 )) { return false; }
+   }
+   
+   {// CTR against the table block function, with the counter carrying out of
+    // its low 64 bits mid-stream, and a partial last block.  Then the same 
+    // stream in pieces split at each block boundary.
+      const int nb = 21, cb = nb*BLK_SIZE - 5;
+      BYTE ctr[BLK_SIZE], c[BLK_SIZE], pt[nb*BLK_SIZE], ct[nb*BLK_SIZE], t[nb*BLK_SIZE];
+      CvtHex( "0123456789abcdeffffffffffffffff6", ctr );
+      for (int i=0; i<cb; i++) { pt[i] = (BYTE)(i*13 + 1); }
+
+      AES_KEY tk; private_AES_set_encrypt_key( key, 128, &tk );
+      memcpy( c, ctr, BLK_SIZE );
+      for (int i=0; i<nb; i++) {
+         AES_encrypt( c, &ct[i*BLK_SIZE], &tk );
+         for (int j=BLK_SIZE-1; 0<=j && 0 == ++c[j]; j--) {}
+      }
+      for (int i=0; i<cb; i++) { ct[i] ^= pt[i]; }
+
+      aes_set_encrypt_key( key, 128, &ks );
+      aes_ctr_encrypt( pt, t, cb, &ks, ctr, 0 );
+      if (0 != memcmp( t, ct, cb )) { return false; }
+      
+      for (int split=1; split<nb; split++) {
+         memcpy( t, pt, cb );
+         aes_ctr_encrypt( t, t, split*BLK_SIZE, &ks, ctr, 0 );
+         aes_ctr_encrypt( t + split*BLK_SIZE, t + split*BLK_SIZE, cb - split*BLK_SIZE, &ks, ctr, split );
+         if (0 != memcmp( t, ct, cb )) { return false; }
+      }
+   }
+
+   {// aes_ctr(): split across four threads against one, raw key and AesKey.
+      const size_t cb = 4 * 256 * 1024 + 7;
+      MemBuf pt( (int)cb ), ct1( (int)cb ), ct2( (int)cb );
+      for (size_t i=0; i<cb; i++) { pt[(int)i] = (BYTE)(i*7 + (i >> 11)); }
+      memset( iv, 0xf7, BLK_SIZE );
+      
+      aes_ctr( pt, ct1, cb, key, iv, 1 );
+      aes_ctr( pt, ct2, cb, AesKey( key ), iv, 4 );
+      if (0 != memcmp( ct1, ct2, cb )) { return false; }
+      aes_ctr( ct2, ct2, cb, key, iv, 4 );
+      if (0 != memcmp( ct2, pt, cb )) { return false; }
+   }
+
+#ifdef JHB_X86
+   {// Bitsliced code against the tables directly, whatever this CPU would pick:
+    // ECB both ways over 13 blocks (one full group, one padded), and CBC 
+    // decrypt in place.  AES-128 and AES-256.
+      const int nb = 13;
+      BYTE pt[nb*BLK_SIZE], ct[nb*BLK_SIZE], t1[nb*BLK_SIZE], t2[nb*BLK_SIZE];
+      for (int i=0; i<(int)sizeof pt; i++) { pt[i] = (BYTE)(i*67 + 11); }
+      
+      for (int bits=128; bits<=256; bits+=128) {
+         AES_KEY ek, dk;
+         private_AES_set_encrypt_key( key, bits, &ek );
+         private_AES_set_decrypt_key( key, bits, &dk );
+         
+         for (int i=0; i<nb; i++) { AES_encrypt( pt + i*BLK_SIZE, ct + i*BLK_SIZE, &ek ); }
+         _bs_ecb( pt, t1, nb, &ek, true );
+         if (0 != memcmp( t1, ct, sizeof ct )) { return false; }
+         _bs_ecb( ct, t1, nb, &dk, false );
+         if (0 != memcmp( t1, pt, sizeof pt )) { return false; }
+         
+         memset( iv, 0x3c, BLK_SIZE );
+         AES_cbc_encrypt( pt, t1, sizeof pt, &ek, iv, AES_ENCRYPT );
+         memcpy( t2, t1, sizeof t1 );
+         BYTE chain[BLK_SIZE];
+         _bs_cbc_decrypt( t2, t2, nb, &dk, iv, chain );
+         if (0 != memcmp( t2, pt, sizeof pt )) { return false; }
+         if (0 != memcmp( chain, t1 + (nb-1)*BLK_SIZE, BLK_SIZE )) { return false; }
+
+#ifdef JHB_SSSE3
+         // _bs_pick() chose one permutation set; check the SSE2 one too.
+         if (CpuFeatures() & CPU_SSSE3) {
+            _bs rk[AES_MAXNR+1][8];
+            _bs_keys( &ek, rk, true );
+            _bs_crypt8<_bsSse2>( pt, t1, rk, ek.rounds, true );
+            if (0 != memcmp( t1, ct, BS_BLOCKS*BLK_SIZE )) { return false; }
+            _bs_keys( &dk, rk, false );
+            _bs_crypt8<_bsSse2>( ct, t1, rk, dk.rounds, false );
+            if (0 != memcmp( t1, pt, BS_BLOCKS*BLK_SIZE )) { return false; }
+         }
+#endif
+      }
+   }
+#endif
+
+   {// Partial last block, against OpenSSL's own CBC.
+      BYTE iv2[BLK_SIZE], out2[64];
+      AES_KEY ks2;
+      for (int len=1; len<=64; len+=7) {
+         memset( iv, 0x5a, BLK_SIZE ); memset( iv2, 0x5a, BLK_SIZE );
+         aes_set_encrypt_key( key, 128, &ks ); aes_cbc_encrypt( in, out, len, &ks, iv, true );
+         private_AES_set_encrypt_key( key, 128, &ks2 ); AES_cbc_encrypt( in, out2, len, &ks2, iv2, AES_ENCRYPT );
+         if (0 != memcmp( out, out2, RoundUp( len, BLK_SIZE ))) { return false; }
+      }
+   }
+
+   return true;
+}
@@ -303,6 +303,7 @@
 // ----------------------------------------------------------------------------    
 
 #include "jhbKrypto.h"
+#include "jhb_aes.h"
 
 #define BLK_SIZE 16
 
@@ -320,10 +321,10 @@ static void AES_128(BYTE *key, BYTE *in, BYTE *out) {
 static BYTE const_Rb[BLK_SIZE] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x87};
 
 // 
-static void GenSubkeys( BYTE *key, BlkBuf &K1, BlkBuf &K2 )
+static void GenSubkeys( const AES_KEY *aks, BlkBuf &K1, BlkBuf &K2 )
 {
     BlkBuf Z, L; Z.zero();
-    AES_128( key, Z, L );
+    aes_ecb_encrypt( Z, L, 1, aks );        // constant-time without AES-NI too
 
     K1.lsh1( L );
     if (L[0]  & 0x80) { K1.xor( const_Rb ); }
@@ -334,16 +335,26 @@ static void GenSubkeys( BYTE *key, BlkBuf &K1, BlkBuf &K2 )
     return;
 }
 
-static void Pad( BYTE *buf, int len, BYTE *out ) {
+static void Pad( const BYTE *buf, int len, BYTE *out ) {
    for (int i=0; i<BLK_SIZE; i++ ) {      
       out[i] = (i < len) ? buf[i] : (i == len) ? 0x80 : 0x00 ;      
    }           
 }
 
-void cmac_aes128 ( BYTE *key, BYTE *in, int length, BYTE *out )
+// ----------------------------------------------------------------------------
+// CmacAesT - the key schedule and subkeys are computed once, here, and then
+// reused for every message MAC'd with this object.  Only the key expansion
+// sees the key size; the CBC-MAC loop (aes_cbc_mac) is compiled per size.
+// ----------------------------------------------------------------------------
+_cmac_aes_t::_cmac_aes_t( const BYTE *key, int bits ) : _ks( sizeof(AES_KEY) ) {
+   aes_set_encrypt_key( key, bits, (AES_KEY *)_ks.ptr() );
+   GenSubkeys( (AES_KEY *)_ks.ptr(), _K1, _K2 );
+   Init();
+}
+
+BYTE *_cmac_aes_t::Mac( const BYTE *in, int length, BYTE *out ) const
 {
-   BlkBuf K1, K2;
-   GenSubkeys( key, K1, K2 );
+   const AES_KEY *aks = (const AES_KEY *)_ks.ptr();
    
    int  Blks = max( 1, (length + BLK_SIZE - 1) / BLK_SIZE );
    bool bPad = (length < (Blks * BLK_SIZE));
@@ -351,19 +362,174 @@ void cmac_aes128 ( BYTE *key, BYTE *in, int length, BYTE *out )
    BlkBuf M_last;
    if (bPad) { 
       Pad( &in[BLK_SIZE*(Blks-1)], length % BLK_SIZE, M_last );
-      M_last.xor( K2 );         
+      M_last.xor( _K2 );         
    } else {
-      M_last.xor( &in[BLK_SIZE*(Blks-1)], K1 );      
+      M_last.xor( (PBYTE)&in[BLK_SIZE*(Blks-1)], _K1 );      
    }
 
    BlkBuf X; X.zero();
-   for (int i=0; i<(Blks-1); i++ ) {
-      X.xor( &in[BLK_SIZE*i] );
-      AES_128( key, X, X );
-   }
+   aes_cbc_mac( in, Blks-1, aks, X );
 
    X.xor( M_last );
-   AES_128( key, X, out );
+   aes_encrypt( X, out, aks );
+   
+   return out;
+}
+
+// ----------------------------------------------------------------------------
+// Streaming interface.  A full pending block is only chained into X once more 
+// input shows up, since the last block of the message gets the K1/K2 treatment.
+// ----------------------------------------------------------------------------
+void _cmac_aes_t::Init() {
+   _X.zero();
+   _M.zero();
+   _n = 0;
+}
+
+void _cmac_aes_t::Update( const BYTE *in, int inlen )
+{
+   const AES_KEY *aks = (const AES_KEY *)_ks.ptr();
+
+   while (0 < inlen) {
+   
+      // More data follows a full pending block, so it is not M_last.
+      if (BLK_SIZE == _n) {
+         _X.xor( _M );
+         aes_encrypt( _X, _X, aks );
+         _n = 0;
+      }
+      
+      // Whole blocks straight from the caller's buffer, holding back the last.
+      if ((0 == _n) && (BLK_SIZE < inlen)) {
+         int blocks = (inlen - 1) / BLK_SIZE;
+         aes_cbc_mac( in, blocks, aks, _X );
+         in    += blocks * BLK_SIZE;
+         inlen -= blocks * BLK_SIZE;
+      }
+      
+      int count = min( BLK_SIZE - _n, inlen );
+      memcpy( &_M[_n], in, count );
+      _n    += count;
+      in    += count;
+      inlen -= count;
+   }
+}
+
+BYTE *_cmac_aes_t::Final( BYTE *out )
+{
+   BlkBuf M_last;
+   if (BLK_SIZE == _n) { M_last.xor( _M, _K1 ); }
+   else {
+      Pad( _M, _n, M_last );
+      M_last.xor( _K2 );
+   }
+   
+   _X.xor( M_last );
+   aes_encrypt( _X, out, (const AES_KEY *)_ks.ptr() );
+   
+   Init();
+   return out;
+}
+
+// ----------------------------------------------------------------------------
+// One-shot AES-CMAC.  Key must be 16 bytes long.  (Returns NULL otherwise.)
+// NOTE: When MAC'ing many messages under one key, use CmacAes128 directly.
+// ----------------------------------------------------------------------------
+BYTE* cmac_aes128( PCBYTE in, int inlen, PCBYTE key, int keylen, BYTE* out )
+{
+   if (BLK_SIZE != keylen) { return NULL; }
+   return CmacAes128( key ).Mac( in, inlen, out );
+}
+
+// ----------------------------------------------------------------------------
+// AesCbcCmac128 - CBC encryption and CMAC of IV || ciphertext in one pass.  
+// The MAC input is always whole blocks, at least two (IV and the padding 
+// block), so only K1 is ever needed.
+// ----------------------------------------------------------------------------
+#define ETM_CHUNK 4096   // bytes per MAC-then-decrypt step in Open(); L1-sized
+
+AesCbcCmac128::AesCbcCmac128( const BYTE *encKey, const BYTE *macKey ) 
+   : _enc( encKey ), _mks( sizeof(AES_KEY) ) 
+{
+   aes_set_encrypt_key( macKey, KeyLen * 8, (AES_KEY *)_mks.ptr() );
+   BlkBuf K2;
+   GenSubkeys( (AES_KEY *)_mks.ptr(), _K1, K2 );
+}
+
+int AesCbcCmac128::Seal( const BYTE *pt, int ptLen, const BYTE *iv, AesCbc128Pkg_t *pkg ) const
+{
+   const AES_KEY *eks = aes_schedule( _enc, true );
+   const AES_KEY *mks = (const AES_KEY *)_mks.ptr();
+   
+   int   whole = ptLen - (ptLen % BLK_SIZE);   // the last block always has padding
+   BYTE *ct    = pkg->ct[0];
+   
+   // The chain starts at the IV; so does the MAC, as its first input block.
+   BYTE chain[BLK_SIZE], X[BLK_SIZE], last[BLK_SIZE];
+   memcpy( pkg->iv, iv, BLK_SIZE );
+   memcpy( chain  , iv, BLK_SIZE );
+   memcpy( X      , iv, BLK_SIZE );
+   
+   aes_cbc_encrypt_mac( pt, ct, whole / BLK_SIZE, eks, chain, mks, X );
+   
+   memcpy( last, pt + whole, ptLen - whole );
+   PadWrite( ptLen - whole, BLK_SIZE, last );
+   aes_cbc_encrypt_mac( last, ct + whole, 1, eks, chain, mks, X );
+   
+   for (int i=0; i<BLK_SIZE; i++) { X[i] ^= _K1[i]; }
+   aes_encrypt( X, ct + whole + BLK_SIZE, mks );
+   
+   SecureZero( last, sizeof last ); SecureZero( X, sizeof X );
+   return CalcSize( ptLen );
+}
+
+int AesCbcCmac128::Open( const AesCbc128Pkg_t *pkg, int size, BYTE *pt ) const
+{
+   int ctLen = size - TagLen - BLK_SIZE;
+   if ((ctLen < BLK_SIZE) || (0 != (ctLen % BLK_SIZE))) { return -1; }
+   
+   const AES_KEY *dks = aes_schedule( _enc, false );
+   const AES_KEY *mks = (const AES_KEY *)_mks.ptr();
+   const BYTE    *ct  = pkg->ct[0];
+   
+   BYTE X[BLK_SIZE], chain[BLK_SIZE], next[BLK_SIZE], last[BLK_SIZE];
+   memset( X, 0, BLK_SIZE );
+   aes_cbc_mac( pkg->iv, 1, mks, X );
+   memcpy( chain, pkg->iv, BLK_SIZE );
+   
+   // Each chunk is MAC'd, then decrypted while it is still in cache.  (next 
+   // saves the chaining block before an in-place decrypt overwrites it.)  The
+   // last block, which holds the padding, is left for below: its MAC step 
+   // takes K1, and only its unpadded bytes go to pt.
+   int bodyLen = ctLen - BLK_SIZE;
+   for (int off=0; off<bodyLen; ) {
+      int n = min( ETM_CHUNK, bodyLen - off );
+      aes_cbc_mac( ct + off, n / BLK_SIZE, mks, X );
+      memcpy( next, ct + off + n - BLK_SIZE, BLK_SIZE );
+      aes_cbc_encrypt( ct + off, pt + off, n, dks, chain, false );
+      memcpy( chain, next, BLK_SIZE );
+      off += n;
+   }
+   memcpy( next, ct + bodyLen, BLK_SIZE );
+   aes_cbc_encrypt( next, last, BLK_SIZE, dks, chain, false );
+   
+   for (int i=0; i<BLK_SIZE; i++) { X[i] ^= next[i] ^ _K1[i]; }
+   aes_encrypt( X, X, mks );
+   
+   // Constant-time tag compare; only then the padding (PadWrite's: n bytes of n).
+   BYTE diff = 0;
+   for (int i=0; i<TagLen; i++) { diff |= X[i] ^ ct[ctLen + i]; }
+   int pad = last[BLK_SIZE - 1];
+   if (0 == diff) {
+      if ((pad < 1) || (BLK_SIZE < pad)) { diff = 1; }
+      else { for (int i=BLK_SIZE-pad; i<BLK_SIZE; i++) { diff |= last[i] ^ (BYTE)pad; } }
+   }
+   
+   if (0 == diff) { memcpy( pt + bodyLen, last, BLK_SIZE - pad ); }
+   else           { SecureZero( pt, bodyLen ); }
+   
+   SecureZero( X, sizeof X ); SecureZero( last, sizeof last );
+   return (0 == diff) ? bodyLen + BLK_SIZE - pad : -1;
 }
 
 // ----------------------------------------------------------------------------
@@ -376,9 +542,10 @@ bool cmac_TEST() {
    
    {// Subkey generation.
       BlkBuf out, K1, K2;
+      AES_KEY aks; aes_set_encrypt_key( key, BLK_SIZE * 8, &aks );
       
       AES_128(key,zero,out);      
-      GenSubkeys(key,K1,K2);   
+      GenSubkeys(&aks,K1,K2);   
       
       CvtHex( "7df76b0c1ab899b33e42f047b91b546f", ref );
       if (0 != memcmp( out, ref, sizeof ref )) { return false; }
@@ -391,7 +558,7 @@ bool cmac_TEST() {
    }
    {// Example 1: len=0
       BYTE out [BLK_SIZE];      
-      cmac_aes128(key,0,0,out);
+      cmac_aes128(0,0,key,BLK_SIZE,out);
       
       CvtHex( "bb1d6929e95937287fa37d129b756746", ref );
       if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
@@ -399,7 +566,7 @@ bool cmac_TEST() {
    {// Example 2: len=16
       BYTE out[BLK_SIZE]; 
       BYTE M  [    16]; CvtHex( "6bc1bee22e409f96e93d7e117393172a", M );     
-      cmac_aes128(key,M,16,out);
+      cmac_aes128(M,16,key,BLK_SIZE,out);
       
       CvtHex( "070a16b46b4d4144f79bdd9dd04a287c", ref );
       if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
@@ -407,7 +574,7 @@ bool cmac_TEST() {
    {// Example 3: len = 40   
       BYTE out[BLK_SIZE]; 
       BYTE M  [      40]; CvtHex( "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411", M );     
-      cmac_aes128(key,M,40,out);
+      cmac_aes128(M,40,key,BLK_SIZE,out);
       
       CvtHex( "dfa66747de9ae63030ca32611497c827", ref );
       if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
@@ -415,11 +582,121 @@ bool cmac_TEST() {
    {// Example 4: len = 64
       BYTE out[BLK_SIZE]; 
       BYTE M  [      64]; CvtHex( "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710", M );           
-      cmac_aes128(key,M,64,out);
+      cmac_aes128(M,64,key,BLK_SIZE,out);
       
       CvtHex( "51f0bebf7e3b9d92fc49741779363cfe", ref );
       if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
    }   
+   {// One key context reused across messages.
+      CmacAes128 cmac( key );
+      BYTE out[BLK_SIZE]; 
+      BYTE M  [      64]; CvtHex( "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710", M );           
+
+      cmac.Mac( M, 0, out );
+      CvtHex( "bb1d6929e95937287fa37d129b756746", ref );
+      if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
+      
+      cmac.Mac( M, 40, out );
+      CvtHex( "dfa66747de9ae63030ca32611497c827", ref );
+      if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
+
+      cmac.Mac( M, 64, out );
+      CvtHex( "51f0bebf7e3b9d92fc49741779363cfe", ref );
+      if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
+   }
+   {// Streaming, fed in uneven pieces.
+      CmacAes128 cmac( key );
+      BYTE out[BLK_SIZE]; 
+      BYTE M  [      64]; CvtHex( "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710", M );           
+
+      cmac.Final( out );
+      CvtHex( "bb1d6929e95937287fa37d129b756746", ref );
+      if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
+      
+      cmac.Update( M, 7 ); cmac.Update( M+7, 9 ); cmac.Update( M+16, 24 );
+      cmac.Final( out );
+      CvtHex( "dfa66747de9ae63030ca32611497c827", ref );
+      if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
+
+      cmac.Update( M, 16 ); cmac.Update( M+16, 0 ); cmac.Update( M+16, 45 ); cmac.Update( M+61, 3 );
+      cmac.Final( out );
+      CvtHex( "51f0bebf7e3b9d92fc49741779363cfe", ref );
+      if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
+   }
+   {// AesCbcCmac128 against the two passes it replaces (aes() over the padded
+    // text, then CMAC of IV || ciphertext), and back through Open: lengths 
+    // around the block and chunk sizes, in place, and with one bit flipped in
+    // each of IV, ciphertext and tag.
+      static const int len[] = { 0, 1, 15, 16, 17, 100, 4095, 4096, 4097, 9000 };
+      const int maxLen = 9000;
+      BYTE ek[16], mk[16], iv[BLK_SIZE], tag[BLK_SIZE];
+      for (int i=0; i<16; i++) { ek[i] = (BYTE)(i + 1); mk[i] = (BYTE)(0xf0 - i); iv[i] = (BYTE)(i * 17); }
+      
+      AesCbcCmac128 etm( ek, mk );
+      MemBuf pt( maxLen ), ref( 2*BLK_SIZE + maxLen ), out( BLK_SIZE + maxLen );
+      MemBuf pkg( AesCbcCmac128::CalcSize( maxLen ));
+      AesCbc128Pkg_t *p = (AesCbc128Pkg_t *)pkg.ptr();
+      for (int i=0; i<maxLen; i++) { pt[i] = (BYTE)(i*31 + 7); }
+      
+      for (int t=0; t<NELEM(len); t++) {
+         int size  = etm.Seal( pt, len[t], iv, p );
+         int ctLen = PadLen( len[t], BLK_SIZE );
+         if (size != AesCbcCmac128::CalcSize( len[t] )) { return false; }
+         
+         memcpy( out, pt, len[t] ); PadWrite( len[t], BLK_SIZE, out );
+         memcpy( ref, iv, BLK_SIZE );
+         aes( out, ref + BLK_SIZE, ctLen, ek, iv, true );
+         cmac_aes128( ref, BLK_SIZE + ctLen, mk, sizeof mk, tag );
+         if (0 != memcmp( p, ref, BLK_SIZE + ctLen )) { return false; }
+         if (0 != memcmp( (BYTE *)p + BLK_SIZE + ctLen, tag, sizeof tag )) { return false; }
+         
+         if (len[t] != etm.Open( p, size, out )) { return false; }
+         if (0 != memcmp( out, pt, len[t] )) { return false; }
+         
+         int flip[] = { 0, BLK_SIZE + ctLen - 1, size - 1 };
+         for (int i=0; i<NELEM(flip); i++) {
+            int at = flip[i];
+            ((BYTE *)p)[at] ^= 0x04;
+            if (-1 != etm.Open( p, size, out )) { return false; }
+            ((BYTE *)p)[at] ^= 0x04;
+         }
+         
+         // In place both ways.
+         memcpy( p->ct, pt, len[t] );
+         if (size != etm.Seal( p->ct[0], len[t], iv, p )) { return false; }
+         if (0 != memcmp( (BYTE *)p + BLK_SIZE + ctLen, tag, sizeof tag )) { return false; }
+         if (len[t] != etm.Open( p, size, p->ct[0] )) { return false; }
+         if (0 != memcmp( p->ct, pt, len[t] )) { return false; }
+      }
+   }
+   {// SP 800-38B D.2/D.3: AES-192 and AES-256, Examples 5-8 and 9-12, one-shot and streaming.
+      static const int   len[] = { 0, 16, 40, 64 };
+      static const char *t192[] = { "d17ddf46adaacde531cac483de7a9367", "9e99a7bf31e710900662f65e617c5184",
+                                    "8a1de5be2eb31aad089a82e6ee908b0e", "a1d5df0eed790f794d77589659f39a11" };
+      static const char *t256[] = { "028962f61b7bf89efc6b551f4667d983", "28a7023f452e8f82bd4bf28d8c37c35c",
+                                    "aaf3d8f1de5640c232f5b169b9c911e6", "e1992190549f6ed5696a2c056c315410" };
+      BYTE k[32], out[BLK_SIZE], M[64]; 
+      CvtHex( "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710", M );           
+
+      CvtHex( "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b", k );
+      CmacAes192 c192( k );
+      CvtHex( "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4", k );
+      CmacAes256 c256( k );
+      
+      for (int i=0; i<NELEM(len); i++) {
+         CvtHex( t192[i], ref );
+         c192.Mac( M, len[i], out );
+         if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
+         c192.Update( M, len[i] / 3 ); c192.Update( M + len[i]/3, len[i] - len[i]/3 ); c192.Final( out );
+         if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
+
+         CvtHex( t256[i], ref );
+         c256.Mac( M, len[i], out );
+         if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
+         c256.Update( M, len[i] / 3 ); c256.Update( M + len[i]/3, len[i] - len[i]/3 ); c256.Final( out );
+         if (0 != memcmp( out, ref, sizeof ref )) { return false; }            
+      }
+   }
 
    return true;
 }
\ No newline at end of file
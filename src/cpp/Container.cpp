@@ -0,0 +1,372 @@
+// ----------------------------------------------------------------------------
+//
+// CONTAINER.CPP
+//
+//   Chunked AES-CBC + CMAC container: random access to large encrypted data.
+//   Each fixed-size chunk is its own AesCbcCmac128 package, so one chunk can
+//   be found, checked and decrypted without touching the others.
+//
+// ----------------------------------------------------------------------------
+//
+// Layout (integers big-endian):
+//
+//   offset  size
+//        0     4   "JHBC"
+//        4     1   version (1)
+//        5     3   zero
+//        8     4   chunk length, plain text bytes per chunk
+//       12     4   zero
+//       16     8   plain text length
+//       24     8   zero
+//       32    16   nonce, random for each container
+//       48    16   CMAC of bytes 0..47 (header key)
+//       64         chunk 0, chunk 1, ...
+//
+//   Every chunk but the last holds 'chunk length' bytes of plain text, and
+//   seals to the same size, so chunk i starts at 64 + i * (sealed size of a
+//   full chunk): the header doubles as the index.  A chunk is IV || CBC
+//   ciphertext (PKCS#7 padded) || CMAC( IV || ciphertext ).
+//
+//   Chunk i's IV is AES_encKey( nonce ^ i ), i in the low 8 bytes.  That is
+//   SP 800-38A Appendix C's way of making unpredictable IVs, and it ties each
+//   chunk to its place: Open checks the stored IV against the one it expects,
+//   so a chunk moved, swapped in from another container or replayed from an
+//   older one fails.  The plain text length is under the header's tag, so
+//   truncation (and extension) fails too.
+//
+//   The header key is CMAC( MAC key, "JHBC header" ), so the header's tag
+//   and the chunks' tags are never under the same key.
+//
+// ----------------------------------------------------------------------------
+
+#include "jhbKrypto.h"
+#include "jhb_aes.h"
+
+#define BLK_SIZE    16
+#define HDR_VERSION 1
+#define HDR_TAGGED  48   // bytes covered by the header's tag
+
+static const BYTE _magic[4] = { 'J', 'H', 'B', 'C' };
+
+static inline unsigned __int64 _ld64( const BYTE *p ) {
+   unsigned __int64 v = 0;
+   for (int i=0; i<8; i++) { v = (v << 8) | p[i]; }
+   return v;
+}
+static inline void _st64( unsigned __int64 v, BYTE *p ) {
+   for (int i=7; 0<=i; i--) { p[i] = (BYTE)v; v >>= 8; }
+}
+// SecureZero for buffers past INT_MAX bytes (SecureZero takes an int).
+static void _zero( BYTE *p, size_t len ) {
+   for (; (size_t)INT_MAX < len; p += INT_MAX, len -= INT_MAX) { SecureZero( p, INT_MAX ); }
+   SecureZero( p, (int)len );
+}
+
+static inline UINT _ld32( const BYTE *p ) { return ((UINT)p[0] << 24) | ((UINT)p[1] << 16) | ((UINT)p[2] << 8) | p[3]; }
+static inline void _st32( UINT v, BYTE *p ) { p[0] = (BYTE)(v >> 24); p[1] = (BYTE)(v >> 16); p[2] = (BYTE)(v >> 8); p[3] = (BYTE)v; }
+
+// The header key, into key (CmacAes128::KeyLen bytes).
+static const BYTE *_hdrKey( const BYTE *macKey, BYTE *key ) {
+   static const char label[] = "JHBC header";
+   return CmacAes128( macKey ).Mac( (const BYTE *)label, sizeof label - 1, key );
+}
+
+// ----------------------------------------------------------------------------
+
+AesChunked128::AesChunked128( const BYTE *encKey, const BYTE *macKey )
+   : _etm( encKey, macKey ), _ivk( encKey ), _hdrMac( _hdrKey( macKey, BlockBuf<CmacAes128::KeyLen>() )), 
+     _ptLen( 0 ), _chunkLen( DefChunkLen )
+{
+   memset( _hdr, 0, sizeof _hdr );
+}
+
+bool AesChunked128::Create( unsigned __int64 ptLen, int chunkLen, const BYTE *nonce, BYTE *hdr )
+{
+   if ((chunkLen < 1) || (MaxChunkLen < chunkLen)) { return false; }
+
+   _ptLen    = ptLen;
+   _chunkLen = chunkLen;
+
+   memset( _hdr, 0, sizeof _hdr );
+   memcpy( _hdr, _magic, sizeof _magic );
+   _hdr[4] = HDR_VERSION;
+   _st32( (UINT)chunkLen, _hdr + 8 );
+   _st64( ptLen, _hdr + 16 );
+   memcpy( _hdr + 32, nonce, NonceLen );
+   _hdrMac.Mac( _hdr, HDR_TAGGED, _hdr + HDR_TAGGED );
+
+   if (hdr) { memcpy( hdr, _hdr, HeaderLen ); }
+   return true;
+}
+
+bool AesChunked128::ReadHeader( const BYTE *hdr )
+{
+   BYTE tag[CmacAes128::MacLen], diff = 0;
+   _hdrMac.Mac( hdr, HDR_TAGGED, tag );
+   for (int i=0; i<(int)sizeof tag; i++) { diff |= tag[i] ^ hdr[HDR_TAGGED + i]; }
+
+   int chunkLen = (int)_ld32( hdr + 8 );
+   if ((0 != diff) || (0 != memcmp( hdr, _magic, sizeof _magic )) || (HDR_VERSION != hdr[4]) ||
+       (chunkLen < 1) || (MaxChunkLen < chunkLen)) {
+      return false;
+   }
+
+   memcpy( _hdr, hdr, HeaderLen );
+   _chunkLen = chunkLen;
+   _ptLen    = _ld64( hdr + 16 );
+   return true;
+}
+
+const BYTE *AesChunked128::HeaderNonce( const BYTE *hdr ) {
+   return hdr + 32;
+}
+
+// --- Layout -----------------------------------------------------------------
+
+unsigned __int64 AesChunked128::Chunks() const {
+   return (_ptLen + _chunkLen - 1) / _chunkLen;
+}
+
+int AesChunked128::ChunkPtLen( unsigned __int64 i ) const {
+   return (i + 1 < Chunks()) ? _chunkLen : (int)(_ptLen - i * _chunkLen);
+}
+
+int AesChunked128::ChunkPkgLen( unsigned __int64 i ) const {
+   return AesCbcCmac128::CalcSize( ChunkPtLen( i ));
+}
+
+unsigned __int64 AesChunked128::ChunkOffset( unsigned __int64 i ) const {
+   return HeaderLen + i * AesCbcCmac128::CalcSize( _chunkLen );
+}
+
+unsigned __int64 AesChunked128::Size() const {
+   unsigned __int64 n = Chunks();
+   return (0 == n) ? HeaderLen : ChunkOffset( n - 1 ) + ChunkPkgLen( n - 1 );
+}
+
+// --- Chunks -----------------------------------------------------------------
+
+// IV for chunk i: the nonce with i XORed into its low 8 bytes, encrypted.
+void AesChunked128::_iv( unsigned __int64 i, BYTE *iv ) const {
+   BYTE b[BLK_SIZE];
+   memcpy( b, _hdr + 32, BLK_SIZE );
+   _st64( _ld64( b + 8 ) ^ i, b + 8 );
+   aes_encrypt( b, iv, aes_schedule( _ivk, true ));
+}
+
+void AesChunked128::SealChunk( unsigned __int64 i, const BYTE *pt, BYTE *out ) const {
+   BYTE iv[BLK_SIZE];
+   _iv( i, iv );
+   _etm.Seal( pt, ChunkPtLen( i ), iv, (AesCbc128Pkg_t *)out );
+}
+
+bool AesChunked128::OpenChunk( unsigned __int64 i, const BYTE *pkg, BYTE *pt ) const {
+   if (Chunks() <= i) { return false; }
+
+   BYTE iv[BLK_SIZE];
+   _iv( i, iv );
+   int len = ChunkPtLen( i );
+   if ((0 != memcmp( pkg, iv, BLK_SIZE )) ||
+       (len != _etm.Open( (const AesCbc128Pkg_t *)pkg, ChunkPkgLen( i ), pt ))) {
+      _zero( pt, len );
+      return false;
+   }
+   return true;
+}
+
+// --- Whole containers -------------------------------------------------------
+//
+// Workers take contiguous runs of chunks, so each one streams through its own
+// part of the input and output.
+
+struct _chunked_job_t {
+   const AesChunked128 *c;
+   const BYTE          *in;
+   BYTE                *out;
+   bool                 bSeal;
+   unsigned __int64     per;       // chunks per worker; the last takes the rest
+   int                  workers;
+   volatile bool        bBad;      // only ever set
+};
+
+static void _chunkedWorker( void *ctx, int w ) {
+   _chunked_job_t *job = (_chunked_job_t *)ctx;
+   const AesChunked128 *c = job->c;
+
+   unsigned __int64 first = job->per * w;
+   unsigned __int64 end   = (w == job->workers - 1) ? c->Chunks() : first + job->per;
+   for (unsigned __int64 i=first; i<end; i++) {
+      size_t ptOff  = (size_t)(i * c->ChunkLen());
+      size_t pkgOff = (size_t)c->ChunkOffset( i );
+      if (job->bSeal) { c->SealChunk( i, job->in + ptOff, job->out + pkgOff ); }
+      else if (!c->OpenChunk( i, job->in + pkgOff, job->out + ptOff )) { job->bBad = true; }
+   }
+}
+
+static bool _chunked( const AesChunked128 *c, const BYTE *in, BYTE *out, bool bSeal, int nThreads ) {
+
+   unsigned __int64 n = c->Chunks();
+   if (0 == n) { return true; }
+
+   int workers = (int)min( n, (unsigned __int64)((0 == nThreads) ? CpuCount() : max( 1, nThreads )));
+   _chunked_job_t job = { c, in, out, bSeal, n / workers, workers, false };
+   if (1 == workers) { _chunkedWorker( &job, 0 ); }
+   else              { RunWorkers( workers, _chunkedWorker, &job ); }
+
+   return !job.bBad;
+}
+
+BYTE *AesChunked128::Encrypt( const BYTE *pt, BYTE *out, int nThreads ) const {
+   memcpy( out, _hdr, HeaderLen );
+   _chunked( this, pt, out, true, nThreads );
+   return out;
+}
+
+bool AesChunked128::Decrypt( const BYTE *in, size_t size, BYTE *pt, int nThreads ) {
+   if ((size < HeaderLen) || !ReadHeader( in ) || (size != Size())) { return false; }
+
+   if (!_chunked( this, in, pt, false, nThreads )) {
+      _zero( pt, (size_t)_ptLen );
+      return false;
+   }
+   return true;
+}
+
+// Only the chunks that [pos, pos + len) falls in are checked and decrypted;
+// partly-read ones go through a scratch chunk.  The header is trusted for the
+// layout, but not for how much of the container is actually in memory.
+bool AesChunked128::Read( const BYTE *in, size_t inLen, unsigned __int64 pos, size_t len, BYTE *out ) const {
+   if ((_ptLen < pos) || (_ptLen - pos < len)) { return false; }
+
+   KeyBuf tmp( _chunkLen );
+   size_t done = 0;
+   while (done < len) {
+      unsigned __int64 i   = (pos + done) / _chunkLen;
+      int              ofs = (int)((pos + done) % _chunkLen);
+      int              n   = (int)min( (size_t)(ChunkPtLen( i ) - ofs), len - done );
+
+      const BYTE *pkg = in + (size_t)ChunkOffset( i );
+      bool bOk;
+      if (inLen < ChunkOffset( i ) + ChunkPkgLen( i )) { bOk = false; }
+      else if (n == ChunkPtLen( i )) { bOk = OpenChunk( i, pkg, out + done ); }
+      else {
+         bOk = OpenChunk( i, pkg, tmp );
+         memcpy( out + done, tmp + ofs, n );
+      }
+      if (!bOk) {
+         _zero( out, len );
+         return false;
+      }
+      done += n;
+   }
+   return true;
+}
+
+// ----------------------------------------------------------------------------
+
+bool container_TEST() {
+
+   BYTE ek[16], mk[16], nonce[AesChunked128::NonceLen];
+   for (int i=0; i<16; i++) { ek[i] = (BYTE)(i*3 + 1); mk[i] = (BYTE)(0x80 + i); nonce[i] = (BYTE)(i*i); }
+
+   const int ptMax = 5000;
+   MemBuf pt( ptMax ), ct( 2*ptMax ), dt( ptMax + 1 ), ct2( 2*ptMax );
+   for (int i=0; i<ptMax; i++) { pt[i] = (BYTE)(i*7 + (i >> 8)); }
+
+   {// Round trip at lengths around the chunk size (empty, one short chunk, exact
+    // multiples, a short last chunk), serial and threaded; and each chunk
+    // against AesCbcCmac128 with the IV worked out by hand.
+      static const int len[] = { 0, 1, 255, 256, 257, 1024, ptMax };
+      for (int t=0; t<NELEM(len); t++) {
+         AesChunked128 w( ek, mk ), r( ek, mk );
+         w.Create( len[t], 256, nonce, NULL );
+         if (w.Chunks() != (unsigned __int64)(len[t] + 255) / 256) { return false; }
+
+         size_t size = (size_t)w.Size();
+         w.Encrypt( pt, ct, 1 );
+         w.Encrypt( pt, ct2, 3 );
+         if (0 != memcmp( ct, ct2, size )) { return false; }
+
+         memset( dt, 0xee, ptMax + 1 );
+         if (!r.Decrypt( ct, size, dt, 4 )) { return false; }
+         if (0 != memcmp( dt, pt, len[t] ) || (0xee != dt[len[t]])) { return false; }
+         if (r.PtLen() != (unsigned __int64)len[t] || (256 != r.ChunkLen())) { return false; }
+
+         AesCbcCmac128 etm( ek, mk );
+         AesKey        ak ( ek );
+         for (unsigned __int64 i=0; i<w.Chunks(); i++) {
+            BYTE b[BLK_SIZE], iv[BLK_SIZE];
+            memcpy( b, nonce, BLK_SIZE ); b[15] ^= (BYTE)i;
+            aes_encrypt( b, iv, aes_schedule( ak, true ));
+            int n = etm.Seal( pt + (size_t)i*256, w.ChunkPtLen( i ), iv, (AesCbc128Pkg_t *)(BYTE *)ct2 );
+            if ((n != w.ChunkPkgLen( i )) || (0 != memcmp( ct2, ct + (size_t)w.ChunkOffset( i ), n ))) { return false; }
+         }
+      }
+   }
+
+   {// Random access, and tampering: a flipped bit, chunks swapped, a chunk from
+    // another container, a truncated container, a header edit.
+      AesChunked128 w( ek, mk ), r( ek, mk );
+      if (w.Create( ptMax, 0, nonce, NULL ) || w.Create( ptMax, AesChunked128::MaxChunkLen + 1, nonce, NULL )) { return false; }
+      if (!w.Create( ptMax, 512, nonce, NULL )) { return false; }
+      size_t size = (size_t)w.Size();
+      w.Encrypt( pt, ct, 0 );
+      if (!r.ReadHeader( ct )) { return false; }
+      if (0 != memcmp( AesChunked128::HeaderNonce( ct ), nonce, sizeof nonce )) { return false; }
+
+      // The header's tag, by hand: under the derived key, not the chunks' MAC key.
+      BYTE hk[CmacAes128::KeyLen], tag[CmacAes128::MacLen];
+      CmacAes128( mk ).Mac( (const BYTE *)"JHBC header", 11, hk );
+      CmacAes128( hk ).Mac( ct, HDR_TAGGED, tag );
+      if (0 != memcmp( tag, ct + HDR_TAGGED, sizeof tag )) { return false; }
+      CmacAes128( mk ).Mac( ct, HDR_TAGGED, tag );
+      if (0 == memcmp( tag, ct + HDR_TAGGED, sizeof tag )) { return false; }
+
+      static const int at[][2] = { {0, 5000}, {0, 1}, {511, 2}, {1000, 1700}, {4999, 1}, {5000, 0}, {3072, 512} };
+      for (int i=0; i<NELEM(at); i++) {
+         memset( dt, 0, ptMax );
+         if (!r.Read( ct, size, at[i][0], at[i][1], dt )) { return false; }
+         if (0 != memcmp( dt, pt + at[i][0], at[i][1] )) { return false; }
+      }
+      if (r.Read( ct, size, 4990, 11, dt )) { return false; }
+
+      // A good header with the body cut short: chunks past the end fail, unread.
+      size_t cut = (size_t)r.ChunkOffset( 9 ) + r.ChunkPkgLen( 9 ) - 1;
+      MemBuf part( cut );
+      memcpy( part, ct, cut );
+      if (!r.Read( part, cut, 8*512, 512, dt ) || (0 != memcmp( dt, pt + 8*512, 512 ))) { return false; }
+      if (r.Read( part, cut, 9*512, 1, dt ) || r.Read( part, cut, 0, ptMax, dt )) { return false; }
+
+      // Only the damaged chunk fails; its neighbours still read.
+      ct[(size_t)r.ChunkOffset( 3 ) + 40] ^= 1;
+      if (r.Decrypt( ct, size, dt, 2 )) { return false; }
+      if (r.Read( ct, size, 3*512 + 10, 1, dt )) { return false; }
+      if (!r.Read( ct, size, 2*512, 512, dt ) || !r.Read( ct, size, 4*512, 512, dt )) { return false; }
+      ct[(size_t)r.ChunkOffset( 3 ) + 40] ^= 1;
+
+      int pkgLen = r.ChunkPkgLen( 1 );
+      memcpy( ct2, ct + (size_t)r.ChunkOffset( 1 ), pkgLen );
+      memcpy( ct + (size_t)r.ChunkOffset( 1 ), ct + (size_t)r.ChunkOffset( 2 ), pkgLen );
+      memcpy( ct + (size_t)r.ChunkOffset( 2 ), ct2, pkgLen );
+      if (r.Read( ct, size, 512, 1, dt ) || r.Read( ct, size, 1024, 1, dt )) { return false; }
+      w.Encrypt( pt, ct, 1 );
+
+      BYTE nonce2[AesChunked128::NonceLen];
+      memcpy( nonce2, nonce, sizeof nonce ); nonce2[0] ^= 0x80;
+      AesChunked128 w2( ek, mk );
+      w2.Create( ptMax, 512, nonce2, NULL );
+      w2.Encrypt( pt, ct2, 1 );
+      memcpy( ct + (size_t)r.ChunkOffset( 4 ), ct2 + (size_t)r.ChunkOffset( 4 ), pkgLen );
+      if (r.Read( ct, size, 4*512, 1, dt )) { return false; }
+      w.Encrypt( pt, ct, 1 );
+
+      if (r.Decrypt( ct, size - 1, dt, 1 )) { return false; }
+
+      ct[16 + 7] ^= 1;   // plain text length
+      if (r.ReadHeader( ct ) || r.Decrypt( ct, size, dt, 1 )) { return false; }
+      ct[16 + 7] ^= 1;
+      if (!r.Decrypt( ct, size, dt, 1 ) || (0 != memcmp( dt, pt, ptMax ))) { return false; }
+   }
+
+   return true;
+}
@@ -0,0 +1,455 @@
+// ----------------------------------------------------------------------------
+//
+// GCM.CPP
+//
+//   AES-GCM-128 (NIST SP 800-38D): CTR encryption plus GHASH authentication
+//   in a single pass over the data.  96-bit nonces, 128-bit tags.
+//
+// ----------------------------------------------------------------------------
+//
+// Notes:
+//
+//   GHASH multiplies in GF(2^128), modulo x^128 + x^7 + x^2 + x + 1, with the
+//   bits of each block taken in "reflected" order: bit 0 is the most
+//   significant bit of byte 0.  Two implementations, picked at run time:
+//
+//   -- PCLMULQDQ.  Blocks are byte-reversed so that the carry-less multiply
+//      sees them as ordinary 128-bit numbers; the product then comes out one
+//      bit short, which the reduction shifts back (Gueron & Kounavis, "Intel
+//      Carry-Less Multiplication Instruction and its Usage for Computing the
+//      GCM Mode", Algorithm 5).  Four blocks are multiplied by H^4..H and
+//      summed before a single reduction.
+//
+//   -- 4-bit tables (Shoup's method, as in OpenSSL's gcm128.c): 16 multiples
+//      of H, one nibble of X at a time.  The table lookups depend on the
+//      data, so this path is not constant-time.
+//
+//   CTR comes from aes_ctr_encrypt(): with a 96-bit nonce, J0 is nonce ||
+//   0^31 || 1, and block i of the message is encrypted with J0 + 1 + i.
+//   The low word can't wrap within the SP 800-38D length limit, so the full
+//   128-bit increment aes_ctr_encrypt() does is the same as GCM's inc32.
+//
+//   Encryption and hashing alternate over GCM_CHUNK bytes at a time, so each
+//   piece is still in L1 when GHASH reads it back: one trip through memory.
+//
+// ----------------------------------------------------------------------------
+//
+// Test vectors, from McGrew & Viega, "The Galois/Counter Mode of Operation":
+//
+//   Test Case 2
+//   K   00000000 00000000 00000000 00000000
+//   P   00000000 00000000 00000000 00000000
+//   IV  00000000 00000000 00000000
+//   C   0388dace 60b6a392 f328c2b9 71b2fe78
+//   T   ab6e47d4 2cec13bd f53a67b2 1257bddf
+//
+//   Test Case 4
+//   K   feffe992 8665731c 6d6a8f94 67308308
+//   P   d9313225 f88406e5 a55909c5 aff5269a
+//       86a7a953 1534f7da 2e4c303d 8a318a72
+//       1c3c0c95 95680953 2fcf0e24 49a6b525
+//       b16aedf5 aa0de657 ba637b39
+//   A   feedface deadbeef feedface deadbeef
+//       abaddad2
+//   IV  cafebabe facedbad decaf888
+//   C   42831ec2 21777424 4b7221b7 84d0d49c
+//       e3aa212f 2c02a4e0 35c17e23 29aca12e
+//       21d514b2 5466931c 7d8f6a5a ac84aa05
+//       1ba30b39 6a0aac97 3d58e091
+//   T   5bc94fbc 3221a5db 94fae95a e7121a47
+//
+// ----------------------------------------------------------------------------
+
+#include "jhbKrypto.h"
+#include "jhb_simd.h"
+#include "jhb_aes.h"
+
+#define BLK_SIZE  16
+#define GCM_CHUNK 4096   // bytes encrypted, then hashed, per step
+
+typedef unsigned __int64 _u64;
+
+struct _u128 { _u64 hi, lo; };
+
+static inline _u64 _ld64( const BYTE *p ) {
+   _u64 v = 0;
+   for (int i=0; i<8; i++) { v = (v << 8) | p[i]; }
+   return v;
+}
+static inline void _st64( _u64 v, BYTE *p ) {
+   for (int i=7; 0<=i; i--) { p[i] = (BYTE)v; v >>= 8; }
+}
+
+// --- GHASH, 4-bit tables ----------------------------------------------------
+
+// Htable[i] = i.H, where the nibble i holds the reflected bits x^0..x^3.
+static void _gcmInit4bit( _u128 Htable[16], const BYTE *H )
+{
+   _u128 V = { _ld64( H ), _ld64( H + 8 ) };
+
+   // V.x: a right shift in the reflected order, reducing what falls off.
+   #define GCM_REDUCE1BIT(V) {                                               \
+         _u64 T = (_u64)0xe100000000000000ULL & (0 - (V.lo & 1));            \
+         V.lo = (V.hi << 63) | (V.lo >> 1);                                  \
+         V.hi = (V.hi >> 1) ^ T;                                             \
+      }
+   Htable[0].hi = 0; Htable[0].lo = 0;
+   Htable[8] = V; GCM_REDUCE1BIT( V );
+   Htable[4] = V; GCM_REDUCE1BIT( V );
+   Htable[2] = V; GCM_REDUCE1BIT( V );
+   Htable[1] = V;
+   #undef GCM_REDUCE1BIT
+
+   for (int i=2; i<16; i<<=1) {
+      for (int j=1; j<i; j++) {
+         Htable[i+j].hi = Htable[i].hi ^ Htable[j].hi;
+         Htable[i+j].lo = Htable[i].lo ^ Htable[j].lo;
+      }
+   }
+}
+
+// What falls off the low end of Z on a 4-bit shift, reduced into the top.
+static const _u64 _rem4bit[16] = {
+   (_u64)0x0000 << 48, (_u64)0x1c20 << 48, (_u64)0x3840 << 48, (_u64)0x2460 << 48,
+   (_u64)0x7080 << 48, (_u64)0x6ca0 << 48, (_u64)0x48c0 << 48, (_u64)0x54e0 << 48,
+   (_u64)0xe100 << 48, (_u64)0xfd20 << 48, (_u64)0xd940 << 48, (_u64)0xc560 << 48,
+   (_u64)0x9180 << 48, (_u64)0x8da0 << 48, (_u64)0xa9c0 << 48, (_u64)0xb5e0 << 48 };
+
+// X = X.H, Horner's rule over the nibbles of X from the last one back.
+static void _gcmMult4bit( BYTE *X, const _u128 Htable[16] )
+{
+   _u128 Z = Htable[X[15] & 0xf];
+
+   for (int i=15; 0<=i; i--) {
+      int nlo = X[i] & 0xf, nhi = X[i] >> 4;
+
+      if (15 != i) {
+         _u64 rem = Z.lo & 0xf;
+         Z.lo  = (Z.hi << 60) | (Z.lo >> 4);
+         Z.hi  = (Z.hi >> 4) ^ _rem4bit[rem];
+         Z.hi ^= Htable[nlo].hi; Z.lo ^= Htable[nlo].lo;
+      }
+      _u64 rem = Z.lo & 0xf;
+      Z.lo  = (Z.hi << 60) | (Z.lo >> 4);
+      Z.hi  = (Z.hi >> 4) ^ _rem4bit[rem];
+      Z.hi ^= Htable[nhi].hi; Z.lo ^= Htable[nhi].lo;
+   }
+   _st64( Z.hi, X ); _st64( Z.lo, X + 8 );
+}
+
+static void _ghash4bit( BYTE *X, const _u128 Htable[16], const BYTE *p, size_t blocks ) {
+   for (; blocks; blocks--, p+=BLK_SIZE) {
+      for (int i=0; i<BLK_SIZE; i++) { X[i] ^= p[i]; }
+      _gcmMult4bit( X, Htable );
+   }
+}
+
+// --- GHASH, PCLMULQDQ -------------------------------------------------------
+
+#ifdef JHB_PCLMUL
+
+static bool _clmul() {
+   return (CPU_PCLMUL | CPU_SSSE3) == (CpuFeatures() & (CPU_PCLMUL | CPU_SSSE3));
+}
+
+static inline __m128i _bswap128( __m128i x ) {
+   return _mm_shuffle_epi8( x, _mm_setr_epi8( 15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0 ));
+}
+
+// 256-bit carry-less product a.b, as lo and hi halves, unreduced.
+static inline void _clmul256( __m128i a, __m128i b, __m128i &lo, __m128i &hi ) {
+   __m128i mid = _mm_xor_si128( _mm_clmulepi64_si128( a, b, 0x10 ), _mm_clmulepi64_si128( a, b, 0x01 ));
+   lo = _mm_xor_si128( _mm_clmulepi64_si128( a, b, 0x00 ), _mm_slli_si128( mid, 8 ));
+   hi = _mm_xor_si128( _mm_clmulepi64_si128( a, b, 0x11 ), _mm_srli_si128( mid, 8 ));
+}
+
+// Shifts a 256-bit product left one bit (the reflected order's missing bit)
+// and reduces it modulo the GCM polynomial.
+static inline __m128i _gfReduce( __m128i lo, __m128i hi )
+{
+   __m128i t7 = _mm_srli_epi32( lo, 31 ), t8 = _mm_srli_epi32( hi, 31 );
+   lo = _mm_slli_epi32( lo, 1 );
+   hi = _mm_slli_epi32( hi, 1 );
+   __m128i t9 = _mm_srli_si128( t7, 12 );
+   lo = _mm_or_si128( lo, _mm_slli_si128( t7, 4 ));
+   hi = _mm_or_si128( _mm_or_si128( hi, _mm_slli_si128( t8, 4 )), t9 );
+
+   t7 = _mm_xor_si128( _mm_xor_si128( _mm_slli_epi32( lo, 31 ), _mm_slli_epi32( lo, 30 )), _mm_slli_epi32( lo, 25 ));
+   t8 = _mm_srli_si128( t7, 4 );
+   lo = _mm_xor_si128( lo, _mm_slli_si128( t7, 12 ));
+
+   __m128i t2 = _mm_xor_si128( _mm_xor_si128( _mm_srli_epi32( lo, 1 ), _mm_srli_epi32( lo, 2 )), _mm_srli_epi32( lo, 7 ));
+   lo = _mm_xor_si128( lo, _mm_xor_si128( t2, t8 ));
+   return _mm_xor_si128( hi, lo );
+}
+
+static inline __m128i _gfMul( __m128i a, __m128i b ) {
+   __m128i lo, hi;
+   _clmul256( a, b, lo, hi );
+   return _gfReduce( lo, hi );
+}
+
+// Hp[i] = H^(i+1), byte-reversed.
+static void _clmulInit( __m128i Hp[4], const BYTE *H ) {
+   Hp[0] = _bswap128( _mm_loadu_si128( (const __m128i *)H ));
+   for (int i=1; i<4; i++) { Hp[i] = _gfMul( Hp[i-1], Hp[0] ); }
+}
+
+static void _ghashClmul( BYTE *X, const __m128i Hp[4], const BYTE *p, size_t blocks )
+{
+   const __m128i *P = (const __m128i *)p;
+   __m128i x = _bswap128( _mm_loadu_si128( (const __m128i *)X ));
+
+   // X' = (X + P0).H^4 + P1.H^3 + P2.H^2 + P3.H
+   for (; blocks >= 4; blocks-=4, P+=4) {
+      __m128i lo, hi, l, h;
+      _clmul256( _mm_xor_si128( x, _bswap128( _mm_loadu_si128( P+0 ))), Hp[3], lo, hi );
+      _clmul256(                   _bswap128( _mm_loadu_si128( P+1 )) , Hp[2], l , h  ); lo = _mm_xor_si128( lo, l ); hi = _mm_xor_si128( hi, h );
+      _clmul256(                   _bswap128( _mm_loadu_si128( P+2 )) , Hp[1], l , h  ); lo = _mm_xor_si128( lo, l ); hi = _mm_xor_si128( hi, h );
+      _clmul256(                   _bswap128( _mm_loadu_si128( P+3 )) , Hp[0], l , h  ); lo = _mm_xor_si128( lo, l ); hi = _mm_xor_si128( hi, h );
+      x = _gfReduce( lo, hi );
+   }
+   for (; blocks; blocks--, P++) {
+      x = _gfMul( _mm_xor_si128( x, _bswap128( _mm_loadu_si128( P ))), Hp[0] );
+   }
+
+   _mm_storeu_si128( (__m128i *)X, _bswap128( x ));
+}
+
+#endif // JHB_PCLMUL
+
+// --- GCM --------------------------------------------------------------------
+
+struct _gcm_t {
+   const AES_KEY *ks;
+   BYTE           J0[BLK_SIZE];   // pre-counter block
+   BYTE           X [BLK_SIZE];   // GHASH accumulator
+   bool           bClmul;
+#ifdef JHB_PCLMUL
+   __m128i        Hp[4];
+#endif
+   _u128          Htable[16];
+};
+
+static void _gcmInit( _gcm_t &g, const AES_KEY *ks, const BYTE *nonce )
+{
+   BYTE H[BLK_SIZE]; memset( H, 0, sizeof H );
+   aes_ecb_encrypt( H, H, 1, ks );
+
+   g.ks = ks;
+   memcpy( g.J0, nonce, AesGcm_NonceLen );
+   g.J0[12] = 0; g.J0[13] = 0; g.J0[14] = 0; g.J0[15] = 1;
+   memset( g.X, 0, sizeof g.X );
+
+#ifdef JHB_PCLMUL
+   g.bClmul = _clmul();
+   if (g.bClmul) { _clmulInit( g.Hp, H ); } else
+#else
+   g.bClmul = false;
+#endif
+   { _gcmInit4bit( g.Htable, H ); }
+
+   SecureZero( H, sizeof H );
+}
+
+// GHASH over len bytes; a partial last block is zero-padded.
+static void _gcmHash( _gcm_t &g, const BYTE *p, size_t len )
+{
+   size_t blocks = len / BLK_SIZE;
+#ifdef JHB_PCLMUL
+   if (g.bClmul) { _ghashClmul( g.X, g.Hp, p, blocks ); } else
+#endif
+   { _ghash4bit( g.X, g.Htable, p, blocks ); }
+
+   size_t rest = len % BLK_SIZE;
+   if (rest) {
+      BYTE last[BLK_SIZE]; memset( last, 0, sizeof last );
+      memcpy( last, p + blocks * BLK_SIZE, rest );
+      _gcmHash( g, last, BLK_SIZE );
+   }
+}
+
+// CTR and GHASH in turns over GCM_CHUNK pieces: the ciphertext is hashed
+// after encryption, before decryption.
+static void _gcmCrypt( _gcm_t &g, const BYTE *in, BYTE *out, size_t cb, bool bEncrypt )
+{
+   for (size_t off=0; off<cb; off+=GCM_CHUNK) {
+      size_t n = min( (size_t)GCM_CHUNK, cb - off );
+      if (!bEncrypt) { _gcmHash( g, in + off, n ); }
+      aes_ctr_encrypt( in + off, out + off, n, g.ks, g.J0, 1 + off / BLK_SIZE );
+      if ( bEncrypt) { _gcmHash( g, out + off, n ); }
+   }
+}
+
+// T = E( J0 ) ^ GHASH( ... || len(A) || len(C) ), lengths in bits.
+static void _gcmTag( _gcm_t &g, size_t aadlen, size_t cb, BYTE *tag )
+{
+   BYTE L[BLK_SIZE];
+   _st64( (_u64)aadlen * 8, L ); _st64( (_u64)cb * 8, L + 8 );
+   _gcmHash( g, L, BLK_SIZE );
+
+   aes_ecb_encrypt( g.J0, tag, 1, g.ks );
+   for (int i=0; i<AesGcm_TagLen; i++) { tag[i] ^= g.X[i]; }
+}
+
+// SP 800-38D limits the plaintext to 2^32 - 2 blocks.
+static bool _gcmLenOk( size_t cb ) { return (_u64)cb <= (_u64)0xfffffffe * BLK_SIZE; }
+
+static bool _gcm( const BYTE *in, BYTE *out, size_t cb, const AES_KEY *ks, const BYTE *nonce,
+                  const BYTE *aad, size_t aadlen, BYTE *tag, bool bEncrypt )
+{
+   if (!_gcmLenOk( cb )) { return false; }
+
+   _gcm_t g;
+   _gcmInit( g, ks, nonce );
+   if (aadlen) { _gcmHash( g, aad, aadlen ); }
+   _gcmCrypt( g, in, out, cb, bEncrypt );
+
+   bool bOk = true;
+   if (bEncrypt) { _gcmTag( g, aadlen, cb, tag ); }
+   else {
+      // Compare without an early exit; never hand out unauthenticated plaintext.
+      BYTE T[AesGcm_TagLen], diff = 0;
+      _gcmTag( g, aadlen, cb, T );
+      for (int i=0; i<AesGcm_TagLen; i++) { diff |= T[i] ^ tag[i]; }
+      bOk = (0 == diff);
+      if (!bOk) { memset( out, 0, cb ); }
+   }
+
+   SecureZero( &g, sizeof g );
+   return bOk;
+}
+
+// ----------------------------------------------------------------------------
+// One-shot AES-GCM-128.  Returns out (NULL if cb is over the GCM limit).
+// ----------------------------------------------------------------------------
+BYTE *aes_gcm_encrypt( const BYTE *in, BYTE *out, size_t cb, const BYTE *key, const BYTE *nonce,
+                       const BYTE *aad, size_t aadlen, BYTE *tag )
+{
+   AES_KEY aks; aes_set_encrypt_key( key, AesKey::KeyLen * 8, &aks );
+   bool bOk = _gcm( in, out, cb, &aks, nonce, aad, aadlen, tag, true );
+   SecureZero( &aks, sizeof aks );
+   return bOk ? out : NULL;
+}
+
+BYTE *aes_gcm_encrypt( const BYTE *in, BYTE *out, size_t cb, const AesKey &key, const BYTE *nonce,
+                       const BYTE *aad, size_t aadlen, BYTE *tag )
+{
+   return _gcm( in, out, cb, aes_schedule( key, true ), nonce, aad, aadlen, tag, true ) ? out : NULL;
+}
+
+// Returns false (and zeroes out) if the tag does not match.
+bool aes_gcm_decrypt( const BYTE *in, BYTE *out, size_t cb, const BYTE *key, const BYTE *nonce,
+                      const BYTE *aad, size_t aadlen, const BYTE *tag )
+{
+   AES_KEY aks; aes_set_encrypt_key( key, AesKey::KeyLen * 8, &aks );
+   bool bOk = _gcm( in, out, cb, &aks, nonce, aad, aadlen, (BYTE *)tag, false );
+   SecureZero( &aks, sizeof aks );
+   return bOk;
+}
+
+bool aes_gcm_decrypt( const BYTE *in, BYTE *out, size_t cb, const AesKey &key, const BYTE *nonce,
+                      const BYTE *aad, size_t aadlen, const BYTE *tag )
+{
+   return _gcm( in, out, cb, aes_schedule( key, true ), nonce, aad, aadlen, (BYTE *)tag, false );
+}
+
+// ----------------------------------------------------------------------------
+
+bool gcm_TEST() {
+
+   BYTE key[BLK_SIZE], nonce[AesGcm_NonceLen], tag[AesGcm_TagLen], ref[64], refTag[AesGcm_TagLen];
+
+   {// Test Case 1: empty everything.
+      memset( key, 0, sizeof key ); memset( nonce, 0, sizeof nonce );
+      aes_gcm_encrypt( 0, 0, 0, key, nonce, 0, 0, tag );
+      CvtHex( "58e2fccefa7e3061367f1d57a4e7455a", refTag );
+      if (0 != memcmp( tag, refTag, sizeof tag )) { return false; }
+      if (!aes_gcm_decrypt( 0, 0, 0, key, nonce, 0, 0, tag )) { return false; }
+   }
+   {// Test Case 2: one zero block.
+      BYTE pt[BLK_SIZE], ct[BLK_SIZE];
+      memset( pt, 0, sizeof pt );
+      aes_gcm_encrypt( pt, ct, sizeof pt, key, nonce, 0, 0, tag );
+      CvtHex( "0388dace60b6a392f328c2b971b2fe78", ref );
+      CvtHex( "ab6e47d42cec13bdf53a67b21257bddf", refTag );
+      if (0 != memcmp( ct , ref   , sizeof ct  )) { return false; }
+      if (0 != memcmp( tag, refTag, sizeof tag )) { return false; }
+   }
+
+   BYTE P[64], A[20];
+   CvtHex( "feffe9928665731c6d6a8f9467308308", key );
+   CvtHex( "cafebabefacedbaddecaf888", nonce );
+   CvtHex( "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+           "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255", P );
+   CvtHex( "feedfacedeadbeeffeedfacedeadbeefabaddad2", A );
+
+   {// Test Case 3: four whole blocks, no AAD.
+      BYTE ct[64];
+      aes_gcm_encrypt( P, ct, 64, key, nonce, 0, 0, tag );
+      CvtHex( "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+              "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985", ref );
+      CvtHex( "4d5c2af327cd64a62cf35abd2ba6fab4", refTag );
+      if (0 != memcmp( ct , ref   , sizeof ct  )) { return false; }
+      if (0 != memcmp( tag, refTag, sizeof tag )) { return false; }
+   }
+   {// Test Case 4: partial last block and AAD; then decryption in place, and
+    // a bad tag, a changed AAD byte and a changed ciphertext byte rejected.
+      BYTE ct[60], pt[60];
+      aes_gcm_encrypt( P, ct, 60, key, nonce, A, sizeof A, tag );
+      CvtHex( "5bc94fbc3221a5db94fae95ae7121a47", refTag );
+      if (0 != memcmp( ct , ref   , sizeof ct  )) { return false; }
+      if (0 != memcmp( tag, refTag, sizeof tag )) { return false; }
+
+      memcpy( pt, ct, sizeof ct );
+      if (!aes_gcm_decrypt( pt, pt, 60, key, nonce, A, sizeof A, tag )) { return false; }
+      if (0 != memcmp( pt, P, sizeof pt )) { return false; }
+
+      tag[15] ^= 1;
+      if (aes_gcm_decrypt( ct, pt, 60, key, nonce, A, sizeof A, tag )) { return false; }
+      for (int i=0; i<(int)sizeof pt; i++) { if (pt[i]) { return false; } }
+      tag[15] ^= 1;
+
+      A[0] ^= 0x80;
+      if (aes_gcm_decrypt( ct, pt, 60, key, nonce, A, sizeof A, tag )) { return false; }
+      A[0] ^= 0x80;
+
+      ct[59] ^= 0x01;
+      if (aes_gcm_decrypt( ct, pt, 60, key, nonce, A, sizeof A, tag )) { return false; }
+   }
+
+#ifdef JHB_PCLMUL
+   {// The two GHASH implementations against each other, over enough blocks
+    // for the four-way loop and its leftovers.
+      if (_clmul()) {
+         BYTE H[BLK_SIZE], X1[BLK_SIZE], X2[BLK_SIZE], M[23*BLK_SIZE];
+         for (int i=0; i<(int)sizeof M; i++) { M[i] = (BYTE)(i*31 + 7); }
+         CvtHex( "66e94bd4ef8a2c3b884cfa59ca342b2e", H );
+         memset( X1, 0x5a, sizeof X1 ); memcpy( X2, X1, sizeof X2 );
+
+         __m128i Hp[4]; _u128 Htable[16];
+         _clmulInit( Hp, H ); _gcmInit4bit( Htable, H );
+         _ghashClmul( X1, Hp, M, 23 ); _ghash4bit( X2, Htable, M, 23 );
+         if (0 != memcmp( X1, X2, sizeof X1 )) { return false; }
+      }
+   }
+#endif
+
+   {// Across several GCM_CHUNKs with AesKey, through the package type.
+      const int ptLen = 3 * GCM_CHUNK + 100;
+      MemBuf pt( ptLen ), pkgBuf( AesGcm128Pkg_t::CalcSize( ptLen )), dt( ptLen );
+      for (int i=0; i<ptLen; i++) { pt[i] = (BYTE)(i*3 + 1); }
+
+      AesGcm128Pkg_t *pkg = (AesGcm128Pkg_t *)pkgBuf.ptr();
+      GenKeyBytes( pkg->nonce, sizeof pkg->nonce );
+      AesKey ak( key );
+      aes_gcm_encrypt( pt, pkg->ct, ptLen, ak, pkg->nonce, A, sizeof A, pkg->tag );
+
+      int ctLen = AesGcm128Pkg_t::ctSize( pkgBuf.size() );
+      if (ctLen != ptLen) { return false; }
+      if (!aes_gcm_decrypt( pkg->ct, dt, ctLen, key, pkg->nonce, A, sizeof A, pkg->tag )) { return false; }
+      if (0 != memcmp( dt, pt, ptLen )) { return false; }
+   }
+
+   return true;
+}
@@ -171,7 +171,7 @@
 
 #include "jhbKrypto.h"
 
-const int  HMAC_KEY_LEN   =   64;
+const int  HMAC_KEY_LEN   =   64;   // key block of the pfnHash form: 64-byte-block hashes only
 const BYTE HMAC_IPAD_BYTE = 0x36;
 const BYTE HMAC_OPAD_BYTE = 0x5C;
 
@@ -181,9 +181,17 @@ typedef BYTE* (* pfnHash)( const BYTE *p, int cb, BYTE *pOut );
 // --------------------------------------------------------------------------------------
 // HMAC per RFC 2104
 // NOTE: parameter 'out' must point to a buffer of at least hashlen bytes.
+// NOTE: SHA-1, SHA-256 and SHA-512 go through HmacKeyT, which hashes the caller's text 
+//       in place and uses the hash's own block size.  Other hash functions only offer a 
+//       one-shot interface, so for them the key block and the text are still 
+//       concatenated into a temporary buffer, and their block must be 64 bytes.
 // --------------------------------------------------------------------------------------
 BYTE* hmac( PCBYTE txt, int txtlen, PCBYTE key, int keylen, BYTE* out, pfnHash hash, int hashlen )
 {
+   if (sha1   == hash) { return hmacT<Sha1Hash  >( txt, txtlen, key, keylen, out ); }
+   if (sha256 == hash) { return hmacT<Sha256Hash>( txt, txtlen, key, keylen, out ); }
+   if (sha512 == hash) { return hmacT<Sha512Hash>( txt, txtlen, key, keylen, out ); }
+   
    // Working key buffer.  (If caller's key is too long, use a hash of it instead.)
    MemBuf K(HMAC_KEY_LEN);
    if (keylen <= HMAC_KEY_LEN) { memcpy( K, key, keylen ); } 
@@ -217,11 +225,213 @@ BYTE* hmac( LPCSTR txt            , LPCSTR key,             BYTE* out, pfnHash h
 // --- Public members ---------------------------------------------------
 //
 
+template <class H> 
+BYTE* hmacT( PCBYTE txt, int txtlen, PCBYTE key, int keylen, BYTE* out ) { return HmacKeyT<H>( key, keylen ).Mac( txt, txtlen, out ); }
+
+template BYTE* hmacT<Sha1Hash  >( PCBYTE, int, PCBYTE, int, BYTE* );
+template BYTE* hmacT<Sha256Hash>( PCBYTE, int, PCBYTE, int, BYTE* );
+template BYTE* hmacT<Sha512Hash>( PCBYTE, int, PCBYTE, int, BYTE* );
+
 // HMAC_SHA1
-BYTE* hmac_sha1( PCBYTE txt, int txtlen, PCBYTE key, int keylen, BYTE* out) { return hmac( txt, txtlen, key, keylen, out, sha1, SHA1_LEN); }
-BYTE* hmac_sha1( LPCSTR txt            , PCBYTE key, int keylen, BYTE* out) { return hmac( txt,         key, keylen, out, sha1, SHA1_LEN); }
-BYTE* hmac_sha1( PCBYTE txt, int txtlen, LPCSTR key,             BYTE* out) { return hmac( txt, txtlen, key,         out, sha1, SHA1_LEN); }
-BYTE* hmac_sha1( LPCSTR txt            , LPCSTR key,             BYTE* out) { return hmac( txt,         key,         out, sha1, SHA1_LEN); }
+BYTE* hmac_sha1( PCBYTE txt, int txtlen, PCBYTE key, int keylen, BYTE* out) { return hmacT<Sha1Hash>( txt, txtlen, key, keylen, out ); }
+BYTE* hmac_sha1( LPCSTR txt            , PCBYTE key, int keylen, BYTE* out) { return hmac_sha1( (BYTE*)txt, (int)strlen(txt),        key, keylen          , out ); }
+BYTE* hmac_sha1( PCBYTE txt, int txtlen, LPCSTR key,             BYTE* out) { return hmac_sha1(        txt, txtlen          , (BYTE*)key, (int)strlen(key), out ); }
+BYTE* hmac_sha1( LPCSTR txt            , LPCSTR key,             BYTE* out) { return hmac_sha1( (BYTE*)txt, (int)strlen(txt), (BYTE*)key, (int)strlen(key), out ); }
+
+// HMAC_SHA256, HMAC_SHA512
+BYTE* hmac_sha256( PCBYTE txt, int txtlen, PCBYTE key, int keylen, BYTE* out) { return hmacT<Sha256Hash>( txt, txtlen, key, keylen, out ); }
+BYTE* hmac_sha512( PCBYTE txt, int txtlen, PCBYTE key, int keylen, BYTE* out) { return hmacT<Sha512Hash>( txt, txtlen, key, keylen, out ); }
+
+//
+// --- HmacKeyT ---------------------------------------------------------
+//
+
+// The object holds three hash contexts: the states after hashing (K ^ ipad) 
+// and (K ^ opad), and the running state of the streaming interface.  Each 
+// one-shot MAC starts from copies of the first two, on the stack.
+enum { CTX_INNER, CTX_OUTER, CTX_STREAM, CTX_COUNT };
+
+template <class H> static typename H::Ctx *_hCtx( const MemBuf &m, int i ) { 
+   return (typename H::Ctx *)m.ptr( i * H::CtxLen ); 
+}
+
+template <class H> HmacKeyT<H>::HmacKeyT( const BYTE *key, int keylen ) : _ctx( CTX_COUNT * H::CtxLen )
+{
+   // Working key block.  (If caller's key is too long, use a hash of it instead.)
+   BYTE K[H::BlockLen]; memset( K, 0, sizeof K );
+   if (keylen <= H::BlockLen) { memcpy( K, key, keylen ); } 
+   else {
+      typename H::Ctx *c = _hCtx<H>( _ctx, CTX_STREAM );
+      H::Init  ( c );
+      H::Update( c, key, keylen );
+      H::Final ( c, K );
+   }
+
+   for (int i=0; i<H::BlockLen; i++) { K[i] ^= HMAC_IPAD_BYTE; }
+   H::Init  ( _hCtx<H>( _ctx, CTX_INNER ));
+   H::Update( _hCtx<H>( _ctx, CTX_INNER ), K, H::BlockLen );
+
+   for (int i=0; i<H::BlockLen; i++) { K[i] ^= HMAC_IPAD_BYTE ^ HMAC_OPAD_BYTE; }
+   H::Init  ( _hCtx<H>( _ctx, CTX_OUTER ));
+   H::Update( _hCtx<H>( _ctx, CTX_OUTER ), K, H::BlockLen );
+   
+   SecureZero( K, sizeof K );
+   Init();
+}
+
+template <class H> BYTE *HmacKeyT<H>::Mac( const BYTE *txt, int txtlen, BYTE *out ) const
+{
+   unsigned __int64 buf[(H::CtxLen + 7) / 8];   // a Ctx, on the stack and aligned
+   typename H::Ctx *ctx = (typename H::Ctx *)buf;
+   BYTE             innerhash[H::HashLen];
+   
+   memcpy( ctx, _hCtx<H>( _ctx, CTX_INNER ), H::CtxLen );
+   H::Update( ctx, txt, txtlen );
+   H::Final ( ctx, innerhash );
+   
+   memcpy( ctx, _hCtx<H>( _ctx, CTX_OUTER ), H::CtxLen );
+   H::Update( ctx, innerhash, sizeof innerhash );
+   H::Final ( ctx, out );
+
+   SecureZero( buf, sizeof buf );
+   SecureZero( innerhash, sizeof innerhash );
+   return out;
+}
+
+template <class H> void HmacKeyT<H>::Midstates( Word *inner, Word *outer ) const
+{
+   H::Chain( _hCtx<H>( _ctx, CTX_INNER ), inner );
+   H::Chain( _hCtx<H>( _ctx, CTX_OUTER ), outer );
+}
+
+// Streaming interface: the text is fed straight into the inner hash state as 
+// it arrives.  Final re-inits the object for the next message.
+template <class H> void HmacKeyT<H>::Init() {
+   memcpy( _hCtx<H>( _ctx, CTX_STREAM ), _hCtx<H>( _ctx, CTX_INNER ), H::CtxLen );
+}
+
+template <class H> void HmacKeyT<H>::Update( const BYTE *txt, int txtlen ) {
+   H::Update( _hCtx<H>( _ctx, CTX_STREAM ), txt, txtlen );
+}
+
+template <class H> BYTE *HmacKeyT<H>::Final( BYTE *out )
+{
+   typename H::Ctx *ctx = _hCtx<H>( _ctx, CTX_STREAM );
+   BYTE             innerhash[H::HashLen];
+   
+   H::Final( ctx, innerhash );
+   
+   memcpy( ctx, _hCtx<H>( _ctx, CTX_OUTER ), H::CtxLen );
+   H::Update( ctx, innerhash, sizeof innerhash );
+   H::Final ( ctx, out );
+
+   SecureZero( innerhash, sizeof innerhash );
+   Init();
+   return out;
+}
+
+template class HmacKeyT<Sha1Hash  >;
+template class HmacKeyT<Sha256Hash>;
+template class HmacKeyT<Sha512Hash>;
+
+//
+// --- Batches ----------------------------------------------------------
+//
+
+// Entries go in groups.  A group's inner hashes run through sha1_multi from 
+// the keys' ipad midstates, then its outer hashes (a block each) from the 
+// opad ones.  A group is a whole number of bitmap bytes, so threads, which 
+// take whole groups, never share a byte.
+#define HMAC_GROUP       64     // a multiple of 8
+#define HMAC_GROUP_MIN   4      // fewest groups worth a thread
+
+struct _hmac_batch_t {
+   const HmacSha1In_t *in;
+   int                 n;
+   BYTE              (*out)[SHA1_LEN];    // sign; NULL to verify
+   int                 taglen;
+   BYTE               *pass;
+   int                 groups;
+   int                 workers;
+};
+
+static void _hmacGroup( const _hmac_batch_t *b, int first, int count )
+{
+   UINT        hi[HMAC_GROUP][5], ho[HMAC_GROUP][5];
+   BYTE        ih[HMAC_GROUP][SHA1_LEN], mac[HMAC_GROUP][SHA1_LEN];
+   const BYTE *msgs[HMAC_GROUP];
+   int         lens[HMAC_GROUP];
+   BYTE       *outs[HMAC_GROUP];
+
+   const HmacSha1In_t *in = b->in + first;
+   for (int j=0; j<count; j++) {
+      if (in[j].ctx) { in[j].ctx->Midstates( hi[j], ho[j] ); }
+      else           { HmacSha1Key( in[j].key, in[j].keylen ).Midstates( hi[j], ho[j] ); }
+      msgs[j] = in[j].msg; lens[j] = in[j].msglen; outs[j] = ih[j];
+   }
+   sha1_multi( msgs, lens, outs, count, hi, Sha1Hash::BlockLen );
+
+   for (int j=0; j<count; j++) {
+      msgs[j] = ih[j]; lens[j] = SHA1_LEN; outs[j] = b->out ? b->out[first + j] : mac[j];
+   }
+   sha1_multi( msgs, lens, outs, count, ho, Sha1Hash::BlockLen );
+
+   // No early outs: the time taken doesn't depend on where a tag differs.
+   if (!b->out) {
+      for (int j=0; j<count; j++) {
+         UINT diff = 0;
+         for (int t=0; t<b->taglen; t++) { diff |= mac[j][t] ^ in[j].tag[t]; }
+         UINT ok = ((diff - 1) >> 8) & 1;
+         b->pass[(first + j) / 8] |= (BYTE)(ok << ((first + j) % 8));
+      }
+   }
+
+   SecureZero( hi, sizeof hi ); SecureZero( ho , sizeof ho  );
+   SecureZero( ih, sizeof ih ); SecureZero( mac, sizeof mac );
+}
+
+static void _hmacBatchWorker( void *ctx, int w ) {
+   _hmac_batch_t *b = (_hmac_batch_t *)ctx;
+   for (int g=w; g<b->groups; g+=b->workers) {
+      int first = g * HMAC_GROUP;
+      _hmacGroup( b, first, min( HMAC_GROUP, b->n - first ));
+   }
+}
+
+static void _hmacBatch( const HmacSha1In_t in[], BYTE out[][SHA1_LEN], int taglen, BYTE *pass, int n, int nThreads )
+{
+   if (n <= 0) { return; }
+
+   _hmac_batch_t b;
+   b.in      = in;
+   b.n       = n;
+   b.out     = out;
+   b.taglen  = taglen;
+   b.pass    = pass;
+   b.groups  = (n + HMAC_GROUP - 1) / HMAC_GROUP;
+   b.workers = max( 1, min( b.groups / HMAC_GROUP_MIN, (0 == nThreads) ? CpuCount() : nThreads ));
+
+   if (1 == b.workers) { _hmacBatchWorker( &b, 0 ); }
+   else                { RunWorkers( b.workers, _hmacBatchWorker, &b ); }
+}
+
+void hmac_sha1_sign( const HmacSha1In_t in[], BYTE out[][SHA1_LEN], int n, int nThreads )
+{
+   _hmacBatch( in, out, 0, NULL, n, nThreads );
+}
+
+int hmac_sha1_verify( const HmacSha1In_t in[], int taglen, BYTE *pass, int n, int nThreads )
+{
+   if (n <= 0) { return 0; }
+   memset( pass, 0, (n + 7) / 8 );
+   if ((taglen < 1) || (SHA1_LEN < taglen)) { return 0; }
+
+   _hmacBatch( in, NULL, taglen, pass, n, nThreads );
+
+   int matches = 0;
+   for (int i=0; i<n; i++) { matches += (pass[i / 8] >> (i % 8)) & 1; }
+   return matches;
+}
 
 //
 // --- TEST -------------------------------------------------------------
@@ -283,7 +493,125 @@ bool hmac_TEST() {
       CvtHex( "e8e99d0f45237d786d6bbaa7965c7808bbff1a91", mDig );
       hmac_sha1( data, mKey, keylen, mOut );
       if (0 != memcmp( mOut, mDig, hashlen )) { return false; }
+      
+      // Same key, precomputed once and used for two messages (case 6 and 7).
+      HmacSha1Key hk( mKey, keylen );
+      hk.Mac( (BYTE*)data, (int)strlen(data), mOut );
+      if (0 != memcmp( mOut, mDig, hashlen )) { return false; }
+      
+      data = "Test Using Larger Than Block-Size Key - Hash Key First";
+      CvtHex( "aa4ae5e15272d00e95705637ce8a3b55ed402112", mDig );                  
+      hk.Mac( (BYTE*)data, (int)strlen(data), mOut );
+      if (0 != memcmp( mOut, mDig, hashlen )) { return false; }
    }                        
+   {  //  test_case =     2, via HmacSha1Key
+      char *key    = "Jefe";
+      char *data   = "what do ya want for nothing?";
+      CvtHex( "effcdf6ae5eb2fa2d27416d5f184df9c259a7c79", mDig );      
+      HmacSha1Key( (BYTE*)key, (int)strlen(key) ).Mac( (BYTE*)data, (int)strlen(data), mOut );
+      if (0 != memcmp( mOut, mDig, hashlen )) { return false; }      
+   }            
+   {  //  test_case =     3, streamed in pieces
+      int keylen  = CvtHex( "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", mKey );
+      int datalen = CvtHex( "dddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddd", mDat);
+      CvtHex( "125d7342b9ac11cd91a39af48aa17b4f63f175d3", mDig );
+      HmacSha1Key hk( mKey, keylen );
+      hk.Update( mDat, 1 ); hk.Update( mDat.ptr(1), 0 ); hk.Update( mDat.ptr(1), datalen - 1 );
+      hk.Final( mOut );
+      if (0 != memcmp( mOut, mDig, hashlen )) { return false; }      
+      
+      // ...and again, to check that Final left the object ready for reuse.
+      hk.Update( mDat, datalen );
+      hk.Final( mOut );
+      if (0 != memcmp( mOut, mDig, hashlen )) { return false; }      
+   }                        
+   {  //  HMAC-SHA256 and HMAC-SHA512, RFC 4231 test cases 1, 2, 6 and 7.  Case 6 and 7 
+      //  keys (131 bytes) are longer than either block, so the key is hashed first.
+      static const struct { char *key, *data, *sha256, *sha512; } v[] = {
+         { "0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b", "Hi There",
+           "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7",
+           "87aa7cdea5ef619d4ff0b4241a1d6cb02379f4e2ce4ec2787ad0b30545e17cde"
+           "daa833b7d6b8a702038b274eaea3f4e4be9d914eeb61f1702e696c203a126854" },
+         { "4a656665", "what do ya want for nothing?",
+           "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843",
+           "164b7a7bfcf819e2e395fbe73b56e0a387bd64222e831fd610270cd7ea250554"
+           "9758bf75c05a994a6d034f65f8f0e6fdcaeab1a34d4a6b4b636e070a38bce737" },
+         { NULL, "Test Using Larger Than Block-Size Key - Hash Key First",
+           "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54",
+           "80b24263c7c1a3ebb71493c1dd7be8b49b46d1f41b4aeec1121b013783f8f352"
+           "6b56d037e05f2598bd0fd2215d6a1e5295e64f73f63f0aec8b915a985d786598" },
+         { NULL, "This is a test using a larger than block-size key and a larger than block-size "
+                 "data. The key needs to be hashed before being used by the HMAC algorithm.",
+           "9b09ffa71b942fcb27635fbcd5b0e944bfdc63644f0713938a7f51535c3a35e2",
+           "e37b6a775dc87dbaa4dfa9f96e5e3ffddebd71f8867289865df5a32d20cdc944"
+           "b6022cac3c4982b10d5eeb55c3e4de15134676fb6de0446065c97440fa8c6a58" },
+      };
+      BYTE key[131], dig[SHA512_LEN], out[SHA512_LEN];
+      for (int i=0; i<(int)(sizeof v / sizeof v[0]); i++) {
+         int   keylen  = 131; 
+         if (v[i].key) { keylen = CvtHex( v[i].key, key ); } else { memset( key, 0xaa, keylen ); }
+         BYTE *data    = (BYTE*)v[i].data;
+         int   datalen = (int)strlen(v[i].data);
+         
+         CvtHex( v[i].sha256, dig );
+         if (0 != memcmp( hmac_sha256( data, datalen, key, keylen, out ), dig, SHA256_LEN )) { return false; }
+         
+         CvtHex( v[i].sha512, dig );
+         if (0 != memcmp( hmac_sha512( data, datalen, key, keylen, out ), dig, SHA512_LEN )) { return false; }
+         
+         // Streamed, split across a block boundary.
+         HmacSha512Key hk( key, keylen );
+         int n = min( datalen, 111 );
+         hk.Update( data, n ); hk.Update( data + n, datalen - n );
+         if (0 != memcmp( hk.Final( out ), dig, SHA512_LEN )) { return false; }
+      }
+   }
+   {  //  Batches against one at a time: a shared key context and raw keys (one longer 
+      //  than a block), message lengths around the padding cases, and enough entries for 
+      //  four workers and a short last group.  Then verify, with every eleventh tag damaged.
+      const int N = 4 * HMAC_GROUP_MIN * HMAC_GROUP + 37;
+      static BYTE msg[200], key[100];
+      for (int i=0; i<(int)sizeof msg; i++) { msg[i] = (BYTE)(i*13 + 5); }
+      for (int i=0; i<(int)sizeof key; i++) { key[i] = (BYTE)(i*7 + 3); }
+      HmacSha1Key hk( key, 20 );
+
+      static HmacSha1In_t in[N];
+      static BYTE mac[N][SHA1_LEN], tag[N][SHA1_LEN], ref[SHA1_LEN];
+      static const int cb[] = { 0, 1, 55, 56, 63, 64, 119, 120, 200 };
+      for (int i=0; i<N; i++) {
+         in[i].msg    = msg;
+         in[i].msglen = cb[i % NELEM(cb)];
+         in[i].ctx    = (i % 3) ? &hk : NULL;
+         in[i].key    = key;
+         in[i].keylen = (i % 2) ? 20 : 100;
+         in[i].tag    = tag[i];
+      }
+      for (int t=1; t<=4; t*=4) {
+         memset( mac, 0, sizeof mac );
+         hmac_sha1_sign( in, mac, N, t );
+         for (int i=0; i<N; i++) {
+            int keylen = in[i].ctx ? 20 : in[i].keylen;
+            hmac_sha1( msg, in[i].msglen, key, keylen, ref );
+            if (0 != memcmp( mac[i], ref, hashlen )) { return false; }
+         }
+      }
+
+      memcpy( tag, mac, sizeof tag );
+      for (int i=0; i<N; i+=11) { tag[i][i % SHA1_LEN] ^= 0x40; }
+      BYTE pass[(N + 7) / 8];
+      if (N - (N + 10) / 11 != hmac_sha1_verify( in, hashlen, pass, N, 3 )) { return false; }
+      for (int i=0; i<N; i++) {
+         if ((0 == i % 11) == (1 == ((pass[i / 8] >> (i % 8)) & 1))) { return false; }
+      }
+      
+      // Truncated tags: only the first 10 bytes count.
+      int expect = 0;
+      for (int i=0; i<N; i++) { 
+         tag[i][15] ^= 1; 
+         expect += ((0 != i % 11) || (10 <= i % SHA1_LEN)) ? 1 : 0;
+      }
+      if (expect != hmac_sha1_verify( in, 10, pass, N, 1 )) { return false; }
+   }
    return true;         
 }
 
@@ -0,0 +1,737 @@
+// ----------------------------------------------------------------------------
+//
+// SHA1.CPP
+//
+//   SHA-1 (FIPS 180-4) compression kernels:
+//   -- the block function behind OpenSSL's SHA1_Update (and so sha1(), HMAC,
+//      PBKDF2...), in SSSE3, AVX2 and SHA-extension versions picked at run time
+//   -- several independent compressions at once, one per SIMD lane
+//
+// ----------------------------------------------------------------------------
+//
+// From FIPS 180-4:
+//
+// 6.1.2 SHA-1 Hash Computation
+//
+//    For t=0 to 79:
+//    {
+//       T = ROTL^5(a) + f_t(b,c,d) + e + K_t + W_t
+//       e = d
+//       d = c
+//       c = ROTL^30(b)
+//       b = a
+//       a = T
+//    }
+//
+//    where W_t = M_t                                          for  0 <= t <= 15
+//              = ROTL^1(W_t-3 ^ W_t-8 ^ W_t-14 ^ W_t-16)      for 16 <= t <= 79
+//
+//    f_t = Ch    (x,y,z) = (x & y) ^ (~x & z)                 for  0 <= t <= 19
+//        = Parity(x,y,z) = x ^ y ^ z                          for 20 <= t <= 39
+//        = Maj   (x,y,z) = (x & y) ^ (x & z) ^ (y & z)        for 40 <= t <= 59
+//        = Parity(x,y,z)                                      for 60 <= t <= 79
+//
+// ----------------------------------------------------------------------------
+//
+// Every lane runs exactly the same instruction stream, so one template body
+// serves the scalar (1 lane), SSE2 (4 lanes) and AVX2 (8 lanes) versions.
+// The template parameter supplies the vector type and its operations.
+//
+// Lane data is word-interleaved ("SoA"): word j of lane k is at [j*lanes + k].
+// Callers such as the batched PBKDF2 keep their state in that layout so there
+// is no transposing inside the hot loop.
+//
+// The single-stream SSSE3/AVX2 versions vectorize only the message schedule
+// (W_t + K_t, four words per instruction; AVX2 does two blocks' schedules at
+// once) and leave the inherently serial rounds in scalar code.  The SHA
+// extension version does all of it in hardware.
+//
+// ----------------------------------------------------------------------------
+
+#include "jhbKrypto.h"
+#include "jhb_simd.h"
+
+extern "C" {
+   #include <openssl/sha.h>
+}
+
+#define MAX_SHA1_LANES 8
+
+static inline UINT _ld32( const BYTE *p ) {
+   return ((UINT)p[0] << 24) | ((UINT)p[1] << 16) | ((UINT)p[2] << 8) | (UINT)p[3];
+}
+
+#define SHA1_K0 0x5a827999
+#define SHA1_K1 0x6ed9eba1
+#define SHA1_K2 0x8f1bbcdc
+#define SHA1_K3 0xca62c1d6
+
+// --- Lane types -------------------------------------------------------------
+
+struct _v1 {  // portable, one lane
+   typedef UINT T;
+   enum { Lanes = 1 };
+   static T    load ( const UINT *p ) { return *p; }
+   static void store( UINT *p, T v  ) { *p = v;    }
+   static T    set1 ( UINT v        ) { return v;  }
+   static T    add  ( T a, T b      ) { return a + b; }
+   static T    xor  ( T a, T b      ) { return a ^ b; }
+   static T    and  ( T a, T b      ) { return a & b; }
+   static T    or   ( T a, T b      ) { return a | b; }
+   template <int N> static T rotl( T a ) { return (a << N) | (a >> (32-N)); }
+   static void done () {}
+};
+
+#ifdef JHB_X86
+struct _v4 {  // SSE2, four lanes
+   typedef __m128i T;
+   enum { Lanes = 4 };
+   static T    load ( const UINT *p ) { return _mm_loadu_si128( (const __m128i *)p ); }
+   static void store( UINT *p, T v  ) { _mm_storeu_si128( (__m128i *)p, v ); }
+   static T    set1 ( UINT v        ) { return _mm_set1_epi32( (int)v ); }
+   static T    add  ( T a, T b      ) { return _mm_add_epi32( a, b ); }
+   static T    xor  ( T a, T b      ) { return _mm_xor_si128( a, b ); }
+   static T    and  ( T a, T b      ) { return _mm_and_si128( a, b ); }
+   static T    or   ( T a, T b      ) { return _mm_or_si128 ( a, b ); }
+   template <int N> static T rotl( T a ) {
+      return _mm_or_si128( _mm_slli_epi32( a, N ), _mm_srli_epi32( a, 32-N ));
+   }
+   static void done () {}
+};
+#endif
+
+#ifdef JHB_AVX2
+struct _v8 {  // AVX2, eight lanes
+   typedef __m256i T;
+   enum { Lanes = 8 };
+   static T    load ( const UINT *p ) { return _mm256_loadu_si256( (const __m256i *)p ); }
+   static void store( UINT *p, T v  ) { _mm256_storeu_si256( (__m256i *)p, v ); }
+   static T    set1 ( UINT v        ) { return _mm256_set1_epi32( (int)v ); }
+   static T    add  ( T a, T b      ) { return _mm256_add_epi32( a, b ); }
+   static T    xor  ( T a, T b      ) { return _mm256_xor_si256( a, b ); }
+   static T    and  ( T a, T b      ) { return _mm256_and_si256( a, b ); }
+   static T    or   ( T a, T b      ) { return _mm256_or_si256 ( a, b ); }
+   template <int N> static T rotl( T a ) {
+      return _mm256_or_si256( _mm256_slli_epi32( a, N ), _mm256_srli_epi32( a, 32-N ));
+   }
+   static void done () { _mm256_zeroupper(); }
+};
+#endif
+
+// --- Kernel -----------------------------------------------------------------
+
+// One round.  W is a 16-entry circular buffer; from round 16 on it is expanded
+// in place (SHA1_WX).
+#define SHA1_W0(t) W[(t)&15]
+#define SHA1_WX(t) \
+   (W[(t)&15] = V::template rotl<1>( V::xor( V::xor( W[((t)-3)&15], W[((t)-8)&15] ), \
+                                             V::xor( W[((t)-14)&15], W[(t)&15] ))))
+
+#define SHA1_ROUND(t,WT,F,K) {                                               \
+      T w   = WT(t);                                                         \
+      T tmp = V::add( V::add( V::template rotl<5>( a ), F ),                \
+                      V::add( V::add( e, K ), w ));                          \
+      e = d; d = c; c = V::template rotl<30>( b ); b = a; a = tmp;           \
+   }
+
+#define SHA1_CH  V::xor( d, V::and( b, V::xor( c, d )))
+#define SHA1_PAR V::xor( b, V::xor( c, d ))
+#define SHA1_MAJ V::or ( V::and( b, c ), V::and( d, V::or( b, c )))
+
+// h_out = h_in + compress( h_in, W ), for V::Lanes lanes whose words are
+// 'stride' UINTs apart.
+template <class V> static void _sha1_x( const UINT *h_in, const UINT *Win, UINT *h_out, int stride )
+{
+   typedef typename V::T T;
+
+   T W[16];
+   for (int t=0; t<16; t++) { W[t] = V::load( &Win[t*stride] ); }
+
+   T h0 = V::load( &h_in[0*stride] ), h1 = V::load( &h_in[1*stride] ), h2 = V::load( &h_in[2*stride] ),
+     h3 = V::load( &h_in[3*stride] ), h4 = V::load( &h_in[4*stride] );
+   T a = h0, b = h1, c = h2, d = h3, e = h4;
+
+   T K;
+   K = V::set1( SHA1_K0 ); for (int t= 0; t<16; t++) SHA1_ROUND( t, SHA1_W0, SHA1_CH , K );
+                           for (int t=16; t<20; t++) SHA1_ROUND( t, SHA1_WX, SHA1_CH , K );
+   K = V::set1( SHA1_K1 ); for (int t=20; t<40; t++) SHA1_ROUND( t, SHA1_WX, SHA1_PAR, K );
+   K = V::set1( SHA1_K2 ); for (int t=40; t<60; t++) SHA1_ROUND( t, SHA1_WX, SHA1_MAJ, K );
+   K = V::set1( SHA1_K3 ); for (int t=60; t<80; t++) SHA1_ROUND( t, SHA1_WX, SHA1_PAR, K );
+
+   V::store( &h_out[0*stride], V::add( h0, a ));
+   V::store( &h_out[1*stride], V::add( h1, b ));
+   V::store( &h_out[2*stride], V::add( h2, c ));
+   V::store( &h_out[3*stride], V::add( h3, d ));
+   V::store( &h_out[4*stride], V::add( h4, e ));
+
+   V::done();
+}
+
+// --- Single-stream block functions ------------------------------------------
+//
+// All take the five chaining words and 'num' consecutive 64-byte blocks.
+
+typedef void (* _pfnBlocks)( UINT h[5], const BYTE *p, size_t num );
+
+// Fully unrolled rounds for the single-stream code, renaming a..e rather than
+// shuffling them.  X(t,K) supplies W_t + K_t.
+#define SHA1_F_CH( b,c,d) ((d) ^ ((b) & ((c) ^ (d))))
+#define SHA1_F_PAR(b,c,d) ((b) ^ (c) ^ (d))
+#define SHA1_F_MAJ(b,c,d) (((b) & (c)) | ((d) & ((b) | (c))))
+#define SHA1_ROTL(x,n)    (((x) << (n)) | ((x) >> (32-(n))))
+
+#define SHA1_R1(t,F,X,K,a,b,c,d,e) { e += SHA1_ROTL(a,5) + F(b,c,d) + X(t,K); b = SHA1_ROTL(b,30); }
+#define SHA1_R5(t,F,X,K) {                                                                   \
+      SHA1_R1( (t)  , F, X, K, a, b, c, d, e );  SHA1_R1( (t)+1, F, X, K, e, a, b, c, d );   \
+      SHA1_R1( (t)+2, F, X, K, d, e, a, b, c );  SHA1_R1( (t)+3, F, X, K, c, d, e, a, b );   \
+      SHA1_R1( (t)+4, F, X, K, b, c, d, e, a );                                              \
+   }
+#define SHA1_R20(t,F,X,K) {                                                                  \
+      SHA1_R5( (t)   , F, X, K );  SHA1_R5( (t)+5 , F, X, K );                               \
+      SHA1_R5( (t)+10, F, X, K );  SHA1_R5( (t)+15, F, X, K );                               \
+   }
+#define SHA1_R80(X) {                                                                        \
+      UINT a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];                                 \
+      SHA1_R20(  0, SHA1_F_CH , X, SHA1_K0 );                                                \
+      SHA1_R20( 20, SHA1_F_PAR, X, SHA1_K1 );                                                \
+      SHA1_R20( 40, SHA1_F_MAJ, X, SHA1_K2 );                                                \
+      SHA1_R20( 60, SHA1_F_PAR, X, SHA1_K3 );                                                \
+      h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;                                 \
+   }
+
+// Portable: schedule computed as it goes, in a 16-word circular buffer.
+#define SHA1_X_C(t,K)  ((K) + (((t) < 16) ? W[(t)&15]                                                 \
+                                          : (W[(t)&15] = SHA1_ROTL( W[((t)-3)&15] ^ W[((t)-8)&15]     \
+                                                                  ^ W[((t)-14)&15] ^ W[(t)&15], 1 ))))
+
+static void _sha1_blocks_c( UINT h[5], const BYTE *p, size_t num )
+{
+   UINT W[16];
+   for (; num; num--, p+=SHA_CBLOCK) {
+      for (int t=0; t<16; t++) { W[t] = _ld32( &p[4*t] ); }
+      SHA1_R80( SHA1_X_C );
+   }
+   SecureZero( W, sizeof W );
+}
+
+#ifdef JHB_SSSE3
+// Rounds over a precomputed W_t + K_t (from _sha1_schedule, below).
+#define SHA1_X_WK(t,K) WK[t]
+
+static inline void _sha1_rounds( UINT h[5], const UINT *WK ) {
+   SHA1_R80( SHA1_X_WK );
+}
+
+// Schedule vector types: W_t..W_t+3 of one block (SSSE3), or of two blocks,
+// one per 128-bit half (AVX2).  AVX2 byte shifts and alignr work within each
+// half, so the same code does both.
+struct _s4 : _v4 {
+   enum { Blocks = 1 };
+   static T load( const BYTE *p, int g ) {
+      const __m128i bswap = _mm_set_epi8( 12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3 );
+      return _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)(p + 16*g) ), bswap );
+   }
+   static T    alignr8( T hi, T lo ) { return _mm_alignr_epi8( hi, lo, 8 ); }
+   static T    srl4   ( T v        ) { return _mm_srli_si128( v, 4  ); }
+   static T    sll12  ( T v        ) { return _mm_slli_si128( v, 12 ); }
+   static void storeWK( UINT *wk, int g, T v ) { _mm_storeu_si128( (__m128i *)&wk[4*g], v ); }
+};
+
+#ifdef JHB_AVX2
+struct _s8 : _v8 {
+   enum { Blocks = 2 };
+   static T load( const BYTE *p, int g ) {
+      const __m256i bswap = _mm256_set_epi8( 12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3,
+                                             12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3 );
+      __m256i v = _mm256_castsi128_si256( _mm_loadu_si128( (const __m128i *)(p + 16*g) ));
+      v = _mm256_inserti128_si256( v, _mm_loadu_si128( (const __m128i *)(p + SHA_CBLOCK + 16*g) ), 1 );
+      return _mm256_shuffle_epi8( v, bswap );
+   }
+   static T    alignr8( T hi, T lo ) { return _mm256_alignr_epi8( hi, lo, 8 ); }
+   static T    srl4   ( T v        ) { return _mm256_srli_si256( v, 4  ); }
+   static T    sll12  ( T v        ) { return _mm256_slli_si256( v, 12 ); }
+   static void storeWK( UINT *wk, int g, T v ) {
+      _mm_storeu_si128( (__m128i *)&wk[     4*g], _mm256_castsi256_si128( v ));
+      _mm_storeu_si128( (__m128i *)&wk[80 + 4*g], _mm256_extracti128_si256( v, 1 ));
+   }
+};
+#endif
+
+// wk[80*b + t] = W_t + K_t for block b.  Vector g holds W_4g..W_4g+3.
+template <class S> static void _sha1_schedule( const BYTE *p, UINT *wk )
+{
+   typedef typename S::T T;
+   static const UINT K[4] = { SHA1_K0, SHA1_K1, SHA1_K2, SHA1_K3 };
+
+   T W[20];
+   for (int g=0; g<4; g++) { W[g] = S::load( p, g ); }
+
+   // 16 <= t < 32: the usual recurrence.  W_t+3 depends on W_t from the same
+   // vector, so it is computed without that term and patched afterwards.
+   for (int g=4; g<8; g++) {
+      T x = S::xor( S::xor( W[g-4], S::alignr8( W[g-3], W[g-4] )),
+                    S::xor( W[g-2], S::srl4( W[g-1] )));
+      W[g] = S::xor( S::template rotl<1>( x ), S::template rotl<2>( S::sll12( x )));
+   }
+
+   // t >= 32: W_t = ROTL^2(W_t-6 ^ W_t-16 ^ W_t-28 ^ W_t-32), which only
+   // reaches back to earlier vectors.
+   for (int g=8; g<20; g++) {
+      W[g] = S::template rotl<2>( S::xor( S::xor( S::alignr8( W[g-1], W[g-2] ), W[g-4] ),
+                                          S::xor( W[g-7], W[g-8] )));
+   }
+
+   for (int g=0; g<20; g++) { S::storeWK( wk, g, S::add( W[g], S::set1( K[g/5] ))); }
+}
+
+static void _sha1_blocks_ssse3( UINT h[5], const BYTE *p, size_t num )
+{
+   // The next block's schedule is built before this block's rounds, so the
+   // two can overlap.
+   UINT wk[2][80];
+   int  i = 0;
+   if (num) { _sha1_schedule<_s4>( p, wk[0] ); }
+   for (; num; num--, p+=SHA_CBLOCK, i^=1) {
+      if (num > 1) { _sha1_schedule<_s4>( p + SHA_CBLOCK, wk[i^1] ); }
+      _sha1_rounds( h, wk[i] );
+   }
+   SecureZero( wk, sizeof wk );
+}
+
+#ifdef JHB_AVX2
+static void _sha1_blocks_avx2( UINT h[5], const BYTE *p, size_t num )
+{
+   UINT wk[2*80];
+   for (; num >= 2; num-=2, p+=2*SHA_CBLOCK) {
+      _sha1_schedule<_s8>( p, wk );
+      _sha1_rounds( h, wk      );
+      _sha1_rounds( h, wk + 80 );
+   }
+   _mm256_zeroupper();
+   SecureZero( wk, sizeof wk );
+
+   if (num) { _sha1_blocks_ssse3( h, p, num ); }
+}
+#endif
+#endif // JHB_SSSE3
+
+#ifdef JHB_SHANI
+// SHA extensions.  Four rounds per SHA1RNDS4; the schedule runs three groups
+// ahead in M[] (SHA1MSG1, xor, SHA1MSG2).  E alternates between E0 and E1.
+#define SHA1_NI_GROUP(g,Ex,Ey) {                                                              \
+      Ex = _mm_sha1nexte_epu32( Ex, M[(g)&3] );                                              \
+      Ey = abcd;                                                                             \
+      if ((3 <= (g)) && ((g) <= 18)) { M[((g)+1)&3] = _mm_sha1msg2_epu32( M[((g)+1)&3], M[(g)&3] ); } \
+      abcd = _mm_sha1rnds4_epu32( abcd, Ex, (g)/5 );                                         \
+      if ((1 <= (g)) && ((g) <= 16)) { M[((g)+3)&3] = _mm_sha1msg1_epu32( M[((g)+3)&3], M[(g)&3] ); } \
+      if ((2 <= (g)) && ((g) <= 17)) { M[((g)+2)&3] = _mm_xor_si128( M[((g)+2)&3], M[(g)&3] ); }      \
+   }
+
+static void _sha1_blocks_shani( UINT h[5], const BYTE *p, size_t num )
+{
+   const __m128i bswap = _mm_set_epi8( 0,1,2,3, 4,5,6,7, 8,9,10,11, 12,13,14,15 );
+
+   // abcd holds a in the top word; E0 holds e in the top word.
+   __m128i abcd = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *)h ), 0x1b );
+   __m128i E0   = _mm_set_epi32( (int)h[4], 0, 0, 0 );
+   __m128i E1, M[4];
+
+   for (; num; num--, p+=SHA_CBLOCK) {
+      __m128i abcd0 = abcd, E00 = E0;
+
+      for (int i=0; i<4; i++) {
+         M[i] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)(p + 16*i) ), bswap );
+      }
+
+      E0   = _mm_add_epi32( E0, M[0] );
+      E1   = abcd;
+      abcd = _mm_sha1rnds4_epu32( abcd, E0, 0 );
+      SHA1_NI_GROUP(  1, E1, E0 ); SHA1_NI_GROUP(  2, E0, E1 ); SHA1_NI_GROUP(  3, E1, E0 );
+      SHA1_NI_GROUP(  4, E0, E1 ); SHA1_NI_GROUP(  5, E1, E0 ); SHA1_NI_GROUP(  6, E0, E1 );
+      SHA1_NI_GROUP(  7, E1, E0 ); SHA1_NI_GROUP(  8, E0, E1 ); SHA1_NI_GROUP(  9, E1, E0 );
+      SHA1_NI_GROUP( 10, E0, E1 ); SHA1_NI_GROUP( 11, E1, E0 ); SHA1_NI_GROUP( 12, E0, E1 );
+      SHA1_NI_GROUP( 13, E1, E0 ); SHA1_NI_GROUP( 14, E0, E1 ); SHA1_NI_GROUP( 15, E1, E0 );
+      SHA1_NI_GROUP( 16, E0, E1 ); SHA1_NI_GROUP( 17, E1, E0 ); SHA1_NI_GROUP( 18, E0, E1 );
+      SHA1_NI_GROUP( 19, E1, E0 );
+
+      E0   = _mm_sha1nexte_epu32( E0, E00 );
+      abcd = _mm_add_epi32( abcd, abcd0 );
+   }
+
+   _mm_storeu_si128( (__m128i *)h, _mm_shuffle_epi32( abcd, 0x1b ));
+   h[4] = (UINT)_mm_extract_epi16( E0, 6 ) | ((UINT)_mm_extract_epi16( E0, 7 ) << 16);
+
+   for (int i=0; i<4; i++) { M[i] = _mm_setzero_si128(); }
+}
+#endif
+
+// Best block function for this CPU.  (Not cached here: CpuFeatures caches the
+// flags, so this is only a few tests.)
+static _pfnBlocks _sha1Blocks()
+{
+   UINT f = CpuFeatures();
+#ifdef JHB_SHANI
+   if ((f & CPU_SHA) && (f & CPU_SSSE3)) { return _sha1_blocks_shani; }
+#endif
+#ifdef JHB_AVX2
+   if (f & CPU_AVX2 ) { return _sha1_blocks_avx2;  }
+#endif
+#ifdef JHB_SSSE3
+   if (f & CPU_SSSE3) { return _sha1_blocks_ssse3; }
+#endif
+   return _sha1_blocks_c;
+}
+
+// ----------------------------------------------------------------------------
+// The block function OpenSSL's SHA1_Update/SHA1_Final/SHA1_Transform call
+// (sha_locl.h is built with SHA1_ASM defined; see jhbKrypto.cpp).
+// ----------------------------------------------------------------------------
+extern "C" void sha1_block_data_order( SHA_CTX *c, const void *p, size_t num )
+{
+   UINT h[5] = { c->h0, c->h1, c->h2, c->h3, c->h4 };
+   _sha1Blocks()( h, (const BYTE *)p, num );
+   c->h0 = h[0]; c->h1 = h[1]; c->h2 = h[2]; c->h3 = h[3]; c->h4 = h[4];
+}
+
+// ----------------------------------------------------------------------------
+// Widest lane count this CPU runs natively.  (Any of 1, 4 or 8 may be passed
+// to sha1_compress_x; narrower hardware just takes more passes.)
+// ----------------------------------------------------------------------------
+int sha1_lanes() {
+#ifdef JHB_AVX2
+   if (CpuFeatures() & CPU_AVX2) { return 8; }
+#endif
+#ifdef JHB_X86
+   if (CpuFeatures() & CPU_SSE2) { return 4; }
+#endif
+   return 1;
+}
+
+// ----------------------------------------------------------------------------
+// Multi-lane compression: h_out = h_in + compress( h_in, W ) in every lane.
+// h_out may alias h_in, or the first five words of W.
+// ----------------------------------------------------------------------------
+void sha1_compress_x( const UINT *h_in, const UINT *W, UINT *h_out, int lanes )
+{
+   int native = sha1_lanes();
+
+#ifdef JHB_AVX2
+   if ((8 == native) && (8 == lanes)) {
+      _sha1_x<_v8>( h_in, W, h_out, lanes );
+      return;
+   }
+#endif
+#ifdef JHB_X86
+   if ((4 <= native) && (0 == (lanes % 4))) {
+      for (int k=0; k<lanes; k+=4) { _sha1_x<_v4>( h_in+k, W+k, h_out+k, lanes ); }
+      return;
+   }
+#endif
+   for (int k=0; k<lanes; k++) { _sha1_x<_v1>( h_in+k, W+k, h_out+k, lanes ); }
+}
+
+// ----------------------------------------------------------------------------
+// Multi-buffer SHA-1: hashes n independent messages, one per SIMD lane.
+//
+// Each lane works through its message a block at a time; when it finishes it
+// writes its digest and picks up the next unassigned message, so a mix of
+// short and long messages keeps every lane busy.  A lane with nothing left
+// hashes a dummy block whose result is thrown away.
+// ----------------------------------------------------------------------------
+struct _sha1_lane_t {
+   int         msg;          // message index, or -1 when idle
+   const BYTE *p;            // message bytes
+   int         full;         // whole 64-byte blocks taken straight from p
+   int         blocks;       // total blocks, including the padded tail
+   int         next;         // next block to hash
+   BYTE        tail[2*SHA_CBLOCK];
+};
+
+static void _sha1LaneStart( _sha1_lane_t &L, UINT *h, int lanes, int k, int msg, const BYTE *p, int len, 
+                            const UINT h0[][5], int done )
+{
+   L.msg    = msg;
+   L.p      = p;
+   L.full   = len / SHA_CBLOCK;
+   L.blocks = (len + 1 + 8 + SHA_CBLOCK - 1) / SHA_CBLOCK;
+   L.next   = 0;
+   
+   // Tail: leftover bytes, 0x80, zeros, 64-bit bit length.
+   int rem = len - L.full * SHA_CBLOCK;
+   int cb  = (L.blocks - L.full) * SHA_CBLOCK;
+   memset( L.tail, 0, cb );
+   memcpy( L.tail, p + L.full * SHA_CBLOCK, rem );
+   L.tail[rem] = 0x80;
+   unsigned __int64 bits = ((unsigned __int64)done + len) * 8;
+   for (int i=0; i<8; i++) { L.tail[cb-1-i] = (BYTE)(bits >> (8*i)); }
+   
+   static const UINT iv[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+   const UINT *h5 = h0 ? h0[msg] : iv;
+   for (int j=0; j<5; j++) { h[j*lanes+k] = h5[j]; }
+}
+
+// One message the plain way, from a midstate.
+static void _sha1From( const UINT h0[5], int done, const BYTE *p, int len, BYTE *out )
+{
+   SHA_CTX ctx;
+   memset( &ctx, 0, sizeof ctx );
+   ctx.h0 = h0[0]; ctx.h1 = h0[1]; ctx.h2 = h0[2]; ctx.h3 = h0[3]; ctx.h4 = h0[4];
+   ctx.Nl = (UINT)done << 3;
+   ctx.Nh = (UINT)done >> 29;
+   SHA1_Update( &ctx, p, len );
+   SHA1_Final ( out, &ctx );
+   SecureZero( &ctx, sizeof ctx );
+}
+
+void sha1_multi( const BYTE * const msgs[], const int lens[], BYTE * const outs[], int n, 
+                 const UINT h0[][5], int done )
+{
+   int lanes = sha1_lanes();
+   
+   // No SIMD, or nothing to interleave: the plain one-stream code is quicker.
+   if ((1 == lanes) || (n < 2)) {
+      for (int i=0; i<n; i++) { 
+         if (h0) { _sha1From( h0[i], done, msgs[i], lens[i], outs[i] ); }
+         else    { sha1     (              msgs[i], lens[i], outs[i] ); }
+      }
+      return;
+   }
+   
+   _sha1_lane_t L[MAX_SHA1_LANES];
+   UINT h[5*MAX_SHA1_LANES], hx[5*MAX_SHA1_LANES], W[16*MAX_SHA1_LANES];
+   
+   int next   = 0;   // next message to hand out
+   int active = 0;
+   for (int k=0; k<lanes; k++) {
+      L[k].msg = -1;
+      if (next < n) { _sha1LaneStart( L[k], h, lanes, k, next, msgs[next], lens[next], h0, done ); next++; active++; }
+   }
+   
+   while (active > 0) {
+      for (int k=0; k<lanes; k++) {
+         if (L[k].msg < 0) {
+            for (int t=0; t<16; t++) { W[t*lanes+k] = 0; }
+            for (int j=0; j<5 ; j++) { h[j*lanes+k] = 0; }
+            continue;
+         }
+         const BYTE *blk = (L[k].next < L[k].full) ? L[k].p    + L[k].next            * SHA_CBLOCK
+                                                   : L[k].tail + (L[k].next - L[k].full) * SHA_CBLOCK;
+         for (int t=0; t<16; t++) { W[t*lanes+k] = _ld32( &blk[4*t] ); }
+      }
+      
+      sha1_compress_x( h, W, hx, lanes );
+      
+      for (int k=0; k<lanes; k++) {
+         if (L[k].msg < 0) { continue; }
+         for (int j=0; j<5; j++) { h[j*lanes+k] = hx[j*lanes+k]; }
+         if (++L[k].next < L[k].blocks) { continue; }
+         
+         // Done: emit the digest, then take the next message if there is one.
+         BYTE *out = outs[L[k].msg];
+         for (int j=0; j<5; j++) {
+            UINT v = h[j*lanes+k];
+            out[4*j] = (BYTE)(v>>24); out[4*j+1] = (BYTE)(v>>16); out[4*j+2] = (BYTE)(v>>8); out[4*j+3] = (BYTE)v;
+         }
+         L[k].msg = -1;
+         active--;
+         if (next < n) { _sha1LaneStart( L[k], h, lanes, k, next, msgs[next], lens[next], h0, done ); next++; active++; }
+      }
+   }
+   
+   // The chaining values are keyed midstates when HMAC batches call this.
+   SecureZero( L, sizeof L ); SecureZero( W, sizeof W );
+   SecureZero( h, sizeof h ); SecureZero( hx, sizeof hx );
+}
+
+// --- Sha1Ctx ----------------------------------------------------------------
+
+static SHA_CTX *_shaCtx( const MemBuf &m ) { return (SHA_CTX *)m.ptr(); }
+
+static inline void _st32( BYTE *p, UINT v ) {
+   p[0] = (BYTE)(v >> 24); p[1] = (BYTE)(v >> 16); p[2] = (BYTE)(v >> 8); p[3] = (BYTE)v;
+}
+
+Sha1Ctx::Sha1Ctx() : _ctx( sizeof(SHA_CTX) ) { Reset(); }
+
+Sha1Ctx::Sha1Ctx( const Sha1Ctx &src ) : _ctx( sizeof(SHA_CTX) ) { src.Clone( *this ); }
+
+Sha1Ctx &Sha1Ctx::operator=( const Sha1Ctx &src ) { src.Clone( *this ); return *this; }
+
+void Sha1Ctx::Clone( Sha1Ctx &dst ) const {
+   if (&dst != this) { memcpy( _shaCtx( dst._ctx ), _shaCtx( _ctx ), sizeof(SHA_CTX) ); }
+}
+
+void Sha1Ctx::Reset() { SHA1_Init( _shaCtx( _ctx )); }
+
+void Sha1Ctx::Update( const BYTE *in, int inlen ) { SHA1_Update( _shaCtx( _ctx ), in, inlen ); }
+
+BYTE *Sha1Ctx::Final( BYTE *out ) {
+   SHA1_Final( out, _shaCtx( _ctx ));
+   Reset();
+   return out;
+}
+
+// Saved state, all big-endian:  h0..h4 (20) | message length in bits (8) | 
+// pending block (64; only the first (bits/8)%64 bytes mean anything).
+BYTE *Sha1Ctx::Save( BYTE *out ) const
+{
+   const SHA_CTX *c = _shaCtx( _ctx );
+   
+   _st32( &out[ 0], c->h0 ); _st32( &out[ 4], c->h1 ); _st32( &out[ 8], c->h2 );
+   _st32( &out[12], c->h3 ); _st32( &out[16], c->h4 );
+   _st32( &out[20], c->Nh ); _st32( &out[24], c->Nl );
+   
+   memset( &out[28], 0, SHA_CBLOCK );
+   memcpy( &out[28], c->data, c->num );
+   
+   return out;
+}
+
+bool Sha1Ctx::Restore( const BYTE *in, int inlen )
+{
+   if (StateLen != inlen) { return false; }
+   
+   SHA_CTX *c = _shaCtx( _ctx );
+   
+   c->h0 = _ld32( &in[ 0] ); c->h1 = _ld32( &in[ 4] ); c->h2 = _ld32( &in[ 8] );
+   c->h3 = _ld32( &in[12] ); c->h4 = _ld32( &in[16] );
+   c->Nh = _ld32( &in[20] ); c->Nl = _ld32( &in[24] );
+   
+   c->num = (c->Nl >> 3) & (SHA_CBLOCK - 1);
+   memset( c->data, 0, sizeof c->data );
+   memcpy( c->data, &in[28], c->num );
+   
+   return true;
+}
+
+// --- Sha1Hash traits (HmacKeyT) ---------------------------------------------
+
+struct Sha1Hash::Ctx : SHA_CTX {};
+
+typedef char _sha1_ctx_fits[(sizeof(Sha1Hash::Ctx) <= Sha1Hash::CtxLen) ? 1 : -1];
+
+void  Sha1Hash::Init  ( Ctx *c )                          { SHA1_Init( c ); }
+void  Sha1Hash::Update( Ctx *c, const BYTE *p, size_t cb ) { SHA1_Update( c, p, cb ); }
+BYTE *Sha1Hash::Final ( Ctx *c, BYTE *out )                { SHA1_Final( out, c ); return out; }
+
+void Sha1Hash::Chain( const Ctx *c, Word h[Words] ) {
+   h[0] = c->h0; h[1] = c->h1; h[2] = c->h2; h[3] = c->h3; h[4] = c->h4;
+}
+
+Sha1Hash::pfnBlocks Sha1Hash::Blocks() { return _sha1Blocks(); }
+
+// ----------------------------------------------------------------------------
+
+bool sha1_TEST() {
+
+   // FIPS 180 "abc" example.
+   BYTE ref[SHA1_LEN]; CvtHex( "a9993e364706816aba3e25717850c26c9cd0d89d", ref );
+   BYTE out[SHA1_LEN];
+   if (0 != memcmp( ref, sha1( (BYTE*)"abc", 3, out ), SHA1_LEN )) { return false; }
+
+   // Every lane count must agree with SHA1_Transform, lane by lane.
+   const int L = 8;
+   UINT W[16*L], h[5*L], hx[5*L];
+   for (int i=0; i<16*L; i++) { W[i] = 0x9e3779b9u * (i+1); }
+   for (int i=0; i< 5*L; i++) { h[i] = 0x7f4a7c15u * (i+3); }
+
+   for (int lanes=1; lanes<=L; lanes*=2) {
+      if (2 == lanes) { continue; }
+      sha1_compress_x( h, W, hx, lanes );
+
+      for (int k=0; k<lanes; k++) {
+         SHA_CTX ctx;
+         ctx.h0 = h[0*lanes+k]; ctx.h1 = h[1*lanes+k]; ctx.h2 = h[2*lanes+k];
+         ctx.h3 = h[3*lanes+k]; ctx.h4 = h[4*lanes+k];
+
+         BYTE blk[SHA_CBLOCK];
+         for (int t=0; t<16; t++) {
+            UINT w = W[t*lanes+k];
+            blk[4*t] = (BYTE)(w>>24); blk[4*t+1] = (BYTE)(w>>16); blk[4*t+2] = (BYTE)(w>>8); blk[4*t+3] = (BYTE)w;
+         }
+         SHA1_Transform( &ctx, blk );
+
+         if (  (ctx.h0 != hx[0*lanes+k]) || (ctx.h1 != hx[1*lanes+k]) || (ctx.h2 != hx[2*lanes+k])
+            || (ctx.h3 != hx[3*lanes+k]) || (ctx.h4 != hx[4*lanes+k])) { return false; }
+      }
+   }
+
+   // Each block function this CPU can run must agree with the portable one.
+   static BYTE data[5*SHA_CBLOCK];
+   for (int i=0; i<(int)sizeof data; i++) { data[i] = (BYTE)(i*131 + 17); }
+   
+   _pfnBlocks pfn[3] = { 0 };
+   UINT f = CpuFeatures();
+#ifdef JHB_SSSE3
+   if (f & CPU_SSSE3) { pfn[0] = _sha1_blocks_ssse3; }
+#endif
+#ifdef JHB_AVX2
+   if (f & CPU_AVX2 ) { pfn[1] = _sha1_blocks_avx2;  }
+#endif
+#ifdef JHB_SHANI
+   if ((f & CPU_SHA) && (f & CPU_SSSE3)) { pfn[2] = _sha1_blocks_shani; }
+#endif
+   for (int i=0; i<NELEM(pfn); i++) {
+      if (!pfn[i]) { continue; }
+      for (int nb=1; nb<=5; nb++) {
+         UINT h1[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 }, h2[5];
+         memcpy( h2, h1, sizeof h1 );
+         _sha1_blocks_c( h1, data, nb );
+         pfn[i]        ( h2, data, nb );
+         if (0 != memcmp( h1, h2, sizeof h1 )) { return false; }
+      }
+   }
+   
+   // Sha1Ctx: uneven pieces, a fork after a common prefix, and a save/restore 
+   // checkpoint, all against one-shot.
+   {
+      BYTE ref[SHA1_LEN], out[SHA1_LEN];
+      sha1( data, sizeof data, ref );
+      
+      Sha1Ctx ctx;
+      int cb[] = { 1, 62, 3, 64, 130, 60 };   // sums to sizeof data
+      int ofs = 0;
+      for (int i=0; i<NELEM(cb); i++) { ctx.Update( data+ofs, cb[i] ); ofs += cb[i]; }
+      if (0 != memcmp( ref, ctx.Final( out ), SHA1_LEN )) { return false; }
+      
+      // Final() resets.
+      ctx.Update( (BYTE*)"abc", 3 );
+      CvtHex( "a9993e364706816aba3e25717850c26c9cd0d89d", ref );
+      if (0 != memcmp( ref, ctx.Final( out ), SHA1_LEN )) { return false; }
+      
+      Sha1Ctx prefix;
+      prefix.Update( data, 100 );
+      Sha1Ctx fork( prefix );
+      prefix.Update( data+100, 20 );
+      fork  .Update( data+100, sizeof data - 100 );
+      if (0 != memcmp( sha1( data, 120, ref ), prefix.Final( out ), SHA1_LEN )) { return false; }
+      if (0 != memcmp( sha1( data, sizeof data, ref ), fork.Final( out ), SHA1_LEN )) { return false; }
+      
+      BYTE state[Sha1Ctx::StateLen];
+      ctx.Update( data, 77 );
+      ctx.Save( state );
+      Sha1Ctx resumed;
+      if (!resumed.Restore( state, sizeof state )) { return false; }
+      resumed.Update( data+77, sizeof data - 77 );
+      if (0 != memcmp( ref, resumed.Final( out ), SHA1_LEN )) { return false; }
+   }
+   
+   // Multi-buffer against one-shot, over lengths that straddle the padding cases.
+   BYTE msg[300];
+   for (int i=0; i<(int)sizeof msg; i++) { msg[i] = (BYTE)(i*7 + 1); }
+   
+   const int N = 21;
+   const BYTE *msgs[N]; int lens[N]; BYTE dig[N][SHA1_LEN]; BYTE *outs[N];
+   for (int i=0; i<N; i++) {
+      static const int cb[] = { 0, 1, 3, 55, 56, 63, 64, 65, 119, 120, 128, 300 };
+      lens[i] = cb[ (i*5) % NELEM(cb) ];
+      msgs[i] = msg;
+      outs[i] = dig[i];
+   }
+   sha1_multi( msgs, lens, outs, N );
+   for (int i=0; i<N; i++) {
+      if (0 != memcmp( dig[i], sha1( msg, lens[i], out ), SHA1_LEN )) { return false; }
+   }
+   
+   return true;
+}
@@ -0,0 +1,663 @@
+// ----------------------------------------------------------------------------
+//
+// SHA2.CPP
+//
+//   SHA-256 and SHA-512 (FIPS 180-4):
+//   -- one-shot sha256() and sha512(), usable wherever a pfnHash is
+//   -- the running state behind Sha256Hash/Sha512Hash, HashCtxT and HmacKeyT
+//   -- block functions in portable, SSSE3, AVX2 and (SHA-256 only) SHA
+//      extension versions, picked at run time
+//
+// ----------------------------------------------------------------------------
+//
+// From FIPS 180-4:
+//
+// 6.2.2 SHA-256 Hash Computation  (6.4.2, SHA-512: 64-bit words, 80 rounds)
+//
+//    W_t = M_t                                                 for  0 <= t <= 15
+//        = s1(W_t-2) + W_t-7 + s0(W_t-15) + W_t-16             for 16 <= t
+//
+//    T1 = h + S1(e) + Ch(e,f,g) + K_t + W_t
+//    T2 = S0(a) + Maj(a,b,c)
+//    h = g;  g = f;  f = e;  e = d + T1;  d = c;  c = b;  b = a;  a = T1 + T2
+//
+//    SHA-256:  S0 = ROTR 2,13,22   S1 = ROTR 6,11,25   s0 = ROTR 7,18 SHR 3   s1 = ROTR 17,19 SHR 10
+//    SHA-512:  S0 = ROTR 28,34,39  S1 = ROTR 14,18,41  s0 = ROTR 1,8 SHR 7    s1 = ROTR 19,61 SHR 6
+//
+// ----------------------------------------------------------------------------
+//
+// As for SHA-1, the SSSE3/AVX2 versions vectorize only the message schedule
+// (four SHA-256 or two SHA-512 words per 128 bits; AVX2 does two blocks'
+// schedules at once) and leave the serial rounds in scalar code.  The SHA
+// extensions cover SHA-256 only.  (The SHA-512 instructions of the newest
+// CPUs are not used.)
+//
+// ----------------------------------------------------------------------------
+
+#include "jhbKrypto.h"
+#include "jhb_simd.h"
+
+typedef unsigned __int64 U64;
+
+// Running state.  len counts bytes; data holds the num bytes of a partial block.
+struct Sha256Hash::Ctx { UINT h[8]; U64 len; UINT num; BYTE data[64];  };
+struct Sha512Hash::Ctx { U64  h[8]; U64 len; UINT num; BYTE data[128]; };
+
+typedef char _sha256CtxFits[(sizeof(Sha256Hash::Ctx) <= Sha256Hash::CtxLen) ? 1 : -1];
+typedef char _sha512CtxFits[(sizeof(Sha512Hash::Ctx) <= Sha512Hash::CtxLen) ? 1 : -1];
+
+static const UINT _K256[64] = {
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+   0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+   0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+   0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+   0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const U64 _K512[80] = {
+   0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+   0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+   0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+   0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+   0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+   0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+   0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+   0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+   0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+   0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+   0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+   0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+   0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+   0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+   0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+   0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+   0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+   0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+   0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+   0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static inline UINT _ld32( const BYTE *p ) {
+   return ((UINT)p[0] << 24) | ((UINT)p[1] << 16) | ((UINT)p[2] << 8) | (UINT)p[3];
+}
+static inline U64 _ld64( const BYTE *p ) {
+   return ((U64)_ld32( p ) << 32) | _ld32( p + 4 );
+}
+
+#define SHA2_ROTR(x,n,w) (((x) >> (n)) | ((x) << ((w)-(n))))
+
+#define SHA256_S0(x) (SHA2_ROTR(x, 2,32) ^ SHA2_ROTR(x,13,32) ^ SHA2_ROTR(x,22,32))
+#define SHA256_S1(x) (SHA2_ROTR(x, 6,32) ^ SHA2_ROTR(x,11,32) ^ SHA2_ROTR(x,25,32))
+#define SHA256_s0(x) (SHA2_ROTR(x, 7,32) ^ SHA2_ROTR(x,18,32) ^ ((x) >>  3))
+#define SHA256_s1(x) (SHA2_ROTR(x,17,32) ^ SHA2_ROTR(x,19,32) ^ ((x) >> 10))
+
+#define SHA512_S0(x) (SHA2_ROTR(x,28,64) ^ SHA2_ROTR(x,34,64) ^ SHA2_ROTR(x,39,64))
+#define SHA512_S1(x) (SHA2_ROTR(x,14,64) ^ SHA2_ROTR(x,18,64) ^ SHA2_ROTR(x,41,64))
+#define SHA512_s0(x) (SHA2_ROTR(x, 1,64) ^ SHA2_ROTR(x, 8,64) ^ ((x) >> 7))
+#define SHA512_s1(x) (SHA2_ROTR(x,19,64) ^ SHA2_ROTR(x,61,64) ^ ((x) >> 6))
+
+#define SHA2_CH( e,f,g) ((g) ^ ((e) & ((f) ^ (g))))
+#define SHA2_MAJ(a,b,c) (((a) & (b)) | ((c) & ((a) | (b))))
+
+// --- Rounds -----------------------------------------------------------------
+//
+// Unrolled by eight, renaming a..h rather than shuffling them: each round 
+// only writes d and h, which become the next round's e and a, so after eight
+// rounds the names are back where they started and the loop can go round 
+// again.  X(t) supplies W_t + K_t.  st[] holds the chaining words.
+
+#define SHA2_R1(t,S0,S1,X,a,b,c,d,e,f,g,h) {                                                 \
+      h += S1(e) + SHA2_CH(e,f,g) + X(t);                                                    \
+      d += h;                                                                                \
+      h += S0(a) + SHA2_MAJ(a,b,c);                                                          \
+   }
+#define SHA2_R8(t,S0,S1,X) {                                                                 \
+      SHA2_R1( (t)  , S0, S1, X, a, b, c, d, e, f, g, h );                                   \
+      SHA2_R1( (t)+1, S0, S1, X, h, a, b, c, d, e, f, g );                                   \
+      SHA2_R1( (t)+2, S0, S1, X, g, h, a, b, c, d, e, f );                                   \
+      SHA2_R1( (t)+3, S0, S1, X, f, g, h, a, b, c, d, e );                                   \
+      SHA2_R1( (t)+4, S0, S1, X, e, f, g, h, a, b, c, d );                                   \
+      SHA2_R1( (t)+5, S0, S1, X, d, e, f, g, h, a, b, c );                                   \
+      SHA2_R1( (t)+6, S0, S1, X, c, d, e, f, g, h, a, b );                                   \
+      SHA2_R1( (t)+7, S0, S1, X, b, c, d, e, f, g, h, a );                                   \
+   }
+#define SHA256_R64(X) {                                                                      \
+      UINT a = st[0], b = st[1], c = st[2], d = st[3], e = st[4], f = st[5], g = st[6], h = st[7]; \
+      for (int t=0; t<64; t+=8) SHA2_R8( t, SHA256_S0, SHA256_S1, X );                       \
+      st[0] += a; st[1] += b; st[2] += c; st[3] += d; st[4] += e; st[5] += f; st[6] += g; st[7] += h; \
+   }
+#define SHA512_R80(X) {                                                                      \
+      U64  a = st[0], b = st[1], c = st[2], d = st[3], e = st[4], f = st[5], g = st[6], h = st[7]; \
+      for (int t=0; t<80; t+=8) SHA2_R8( t, SHA512_S0, SHA512_S1, X );                       \
+      st[0] += a; st[1] += b; st[2] += c; st[3] += d; st[4] += e; st[5] += f; st[6] += g; st[7] += h; \
+   }
+
+// --- Block functions --------------------------------------------------------
+//
+// All take the eight chaining words and 'num' consecutive blocks.
+
+typedef void (* _pfnBlocks256)( UINT st[8], const BYTE *p, size_t num );
+typedef void (* _pfnBlocks512)( U64  st[8], const BYTE *p, size_t num );
+
+// Portable: schedule computed as it goes, in a 16-word circular buffer.
+#define SHA256_X_C(t) (_K256[t] + (((t) < 16) ? W[(t)&15]                                           \
+                                  : (W[(t)&15] += SHA256_s1( W[((t)-2)&15] ) + W[((t)-7)&15]        \
+                                                + SHA256_s0( W[((t)-15)&15] ))))
+#define SHA512_X_C(t) (_K512[t] + (((t) < 16) ? W[(t)&15]                                           \
+                                  : (W[(t)&15] += SHA512_s1( W[((t)-2)&15] ) + W[((t)-7)&15]        \
+                                                + SHA512_s0( W[((t)-15)&15] ))))
+
+static void _sha256_blocks_c( UINT st[8], const BYTE *p, size_t num )
+{
+   UINT W[16];
+   for (; num; num--, p+=Sha256Hash::BlockLen) {
+      for (int t=0; t<16; t++) { W[t] = _ld32( &p[4*t] ); }
+      SHA256_R64( SHA256_X_C );
+   }
+   SecureZero( W, sizeof W );
+}
+
+static void _sha512_blocks_c( U64 st[8], const BYTE *p, size_t num )
+{
+   U64 W[16];
+   for (; num; num--, p+=Sha512Hash::BlockLen) {
+      for (int t=0; t<16; t++) { W[t] = _ld64( &p[8*t] ); }
+      SHA512_R80( SHA512_X_C );
+   }
+   SecureZero( W, sizeof W );
+}
+
+#ifdef JHB_SSSE3
+// Rounds over a precomputed W_t + K_t (from the schedules, below).
+#define SHA2_X_WK(t) wk[t]
+
+static inline void _sha256_rounds( UINT st[8], const UINT *wk ) { SHA256_R64( SHA2_X_WK ); }
+static inline void _sha512_rounds( U64  st[8], const U64  *wk ) { SHA512_R80( SHA2_X_WK ); }
+
+// Schedule vector types: 16 bytes of one block (SSSE3), or of two blocks, one 
+// per 128-bit half (AVX2).  AVX2 shuffles and alignr work within each half, 
+// so the same schedule code does both.  'second' is the distance to the other 
+// block's bytes, or to its W_t + K_t.
+struct _sha2x4 {
+   typedef __m128i T;
+   enum { Blocks = 1 };
+   static T    load ( const BYTE *p, size_t second ) { return _mm_loadu_si128( (const __m128i *)p ); }
+   static T    bcast( const void *p                ) { return _mm_loadu_si128( (const __m128i *)p ); }
+   static void store( BYTE *p, size_t second, T v  ) { _mm_storeu_si128( (__m128i *)p, v ); }
+   static T    bswap32( T v ) { return _mm_shuffle_epi8( v, _mm_set_epi8( 12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3 )); }
+   static T    bswap64( T v ) { return _mm_shuffle_epi8( v, _mm_set_epi8( 8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7 )); }
+   static T    add32( T a, T b ) { return _mm_add_epi32( a, b ); }
+   static T    add64( T a, T b ) { return _mm_add_epi64( a, b ); }
+   static T    xor  ( T a, T b ) { return _mm_xor_si128( a, b ); }
+   static T    or   ( T a, T b ) { return _mm_or_si128 ( a, b ); }
+   template <int N> static T srl32( T v ) { return _mm_srli_epi32( v, N ); }
+   template <int N> static T sll32( T v ) { return _mm_slli_epi32( v, N ); }
+   template <int N> static T srl64( T v ) { return _mm_srli_epi64( v, N ); }
+   template <int N> static T sll64( T v ) { return _mm_slli_epi64( v, N ); }
+   static T    alignr4( T hi, T lo ) { return _mm_alignr_epi8( hi, lo, 4 ); }
+   static T    alignr8( T hi, T lo ) { return _mm_alignr_epi8( hi, lo, 8 ); }
+   static T    hi64   ( T v        ) { return _mm_shuffle_epi32( v, 0xee ); }
+   static T    unpack64( T lo, T hi ) { return _mm_unpacklo_epi64( lo, hi ); }
+   static void done() {}
+};
+
+#ifdef JHB_AVX2
+struct _sha2x8 {
+   typedef __m256i T;
+   enum { Blocks = 2 };
+   static T load( const BYTE *p, size_t second ) {
+      return _mm256_inserti128_si256( _mm256_castsi128_si256( _mm_loadu_si128( (const __m128i *)p )), 
+                                      _mm_loadu_si128( (const __m128i *)(p + second) ), 1 );
+   }
+   static T    bcast( const void *p ) { return _mm256_broadcastsi128_si256( _mm_loadu_si128( (const __m128i *)p )); }
+   static void store( BYTE *p, size_t second, T v ) {
+      _mm_storeu_si128( (__m128i *)p           , _mm256_castsi256_si128   ( v    ));
+      _mm_storeu_si128( (__m128i *)(p + second), _mm256_extracti128_si256 ( v, 1 ));
+   }
+   static T    bswap32( T v ) { return _mm256_shuffle_epi8( v, _mm256_set_epi8( 12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3,
+                                                                                12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3 )); }
+   static T    bswap64( T v ) { return _mm256_shuffle_epi8( v, _mm256_set_epi8( 8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,
+                                                                                8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7 )); }
+   static T    add32( T a, T b ) { return _mm256_add_epi32( a, b ); }
+   static T    add64( T a, T b ) { return _mm256_add_epi64( a, b ); }
+   static T    xor  ( T a, T b ) { return _mm256_xor_si256( a, b ); }
+   static T    or   ( T a, T b ) { return _mm256_or_si256 ( a, b ); }
+   template <int N> static T srl32( T v ) { return _mm256_srli_epi32( v, N ); }
+   template <int N> static T sll32( T v ) { return _mm256_slli_epi32( v, N ); }
+   template <int N> static T srl64( T v ) { return _mm256_srli_epi64( v, N ); }
+   template <int N> static T sll64( T v ) { return _mm256_slli_epi64( v, N ); }
+   static T    alignr4( T hi, T lo ) { return _mm256_alignr_epi8( hi, lo, 4 ); }
+   static T    alignr8( T hi, T lo ) { return _mm256_alignr_epi8( hi, lo, 8 ); }
+   static T    hi64   ( T v        ) { return _mm256_shuffle_epi32( v, 0xee ); }
+   static T    unpack64( T lo, T hi ) { return _mm256_unpacklo_epi64( lo, hi ); }
+   static void done() { _mm256_zeroupper(); }
+};
+#endif
+
+#define SHA2_ROTRV(S,w,x,n) S::or( S::template srl##w<n>( x ), S::template sll##w<w-n>( x ))
+
+// wk[64*b + t] = W_t + K_t for block b.  Vector g holds W_4g..W_4g+3.  The
+// s1 term for W_t+2 and W_t+3 needs W_t and W_t+1 from the same vector, so 
+// each vector is made in two halves.
+template <class S> static void _sha256_schedule( const BYTE *p, UINT *wk )
+{
+   typedef typename S::T T;
+   
+   #define SHA256_s0V(x) S::xor( S::xor( SHA2_ROTRV(S,32,x, 7), SHA2_ROTRV(S,32,x,18) ), S::template srl32< 3>( x ))
+   #define SHA256_s1V(x) S::xor( S::xor( SHA2_ROTRV(S,32,x,17), SHA2_ROTRV(S,32,x,19) ), S::template srl32<10>( x ))
+
+   T W[16];
+   for (int g=0; g<4; g++) { W[g] = S::bswap32( S::load( p + 16*g, Sha256Hash::BlockLen )); }
+
+   for (int g=4; g<16; g++) {
+      T x  = S::add32( S::add32( W[g-4], SHA256_s0V( S::alignr4( W[g-3], W[g-4] ))), 
+                       S::alignr4( W[g-1], W[g-2] ));
+      T lo = S::add32( x, SHA256_s1V( S::hi64( W[g-1] )));       // W_t, W_t+1 in the low half
+      T hi = S::add32( S::hi64( x ), SHA256_s1V( lo ));          // W_t+2, W_t+3 in the low half
+      W[g] = S::unpack64( lo, hi );
+   }
+
+   for (int g=0; g<16; g++) { 
+      S::store( (BYTE *)&wk[4*g], 64*sizeof(UINT), S::add32( W[g], S::bcast( &_K256[4*g] ))); 
+   }
+   S::done();
+   
+   #undef SHA256_s0V
+   #undef SHA256_s1V
+}
+
+// wk[80*b + t] = W_t + K_t for block b.  Vector g holds W_2g and W_2g+1, 
+// which only depend on earlier vectors.
+template <class S> static void _sha512_schedule( const BYTE *p, U64 *wk )
+{
+   typedef typename S::T T;
+   
+   #define SHA512_s0V(x) S::xor( S::xor( SHA2_ROTRV(S,64,x, 1), SHA2_ROTRV(S,64,x, 8) ), S::template srl64<7>( x ))
+   #define SHA512_s1V(x) S::xor( S::xor( SHA2_ROTRV(S,64,x,19), SHA2_ROTRV(S,64,x,61) ), S::template srl64<6>( x ))
+
+   T W[40];
+   for (int g=0; g<8; g++) { W[g] = S::bswap64( S::load( p + 16*g, Sha512Hash::BlockLen )); }
+
+   for (int g=8; g<40; g++) {
+      W[g] = S::add64( S::add64( W[g-8], SHA512_s0V( S::alignr8( W[g-7], W[g-8] ))),
+                       S::add64( S::alignr8( W[g-3], W[g-4] ), SHA512_s1V( W[g-1] )));
+   }
+
+   for (int g=0; g<40; g++) { 
+      S::store( (BYTE *)&wk[2*g], 80*sizeof(U64), S::add64( W[g], S::bcast( &_K512[2*g] ))); 
+   }
+   S::done();
+   
+   #undef SHA512_s0V
+   #undef SHA512_s1V
+}
+
+static void _sha256_blocks_ssse3( UINT st[8], const BYTE *p, size_t num )
+{
+   UINT wk[64];
+   for (; num; num--, p+=Sha256Hash::BlockLen) {
+      _sha256_schedule<_sha2x4>( p, wk );
+      _sha256_rounds( st, wk );
+   }
+   SecureZero( wk, sizeof wk );
+}
+
+static void _sha512_blocks_ssse3( U64 st[8], const BYTE *p, size_t num )
+{
+   U64 wk[80];
+   for (; num; num--, p+=Sha512Hash::BlockLen) {
+      _sha512_schedule<_sha2x4>( p, wk );
+      _sha512_rounds( st, wk );
+   }
+   SecureZero( wk, sizeof wk );
+}
+
+#ifdef JHB_AVX2
+// Two blocks' schedules at once; an odd last block goes to SSSE3.
+static void _sha256_blocks_avx2( UINT st[8], const BYTE *p, size_t num )
+{
+   UINT wk[2*64];
+   for (; num >= 2; num-=2, p+=2*Sha256Hash::BlockLen) {
+      _sha256_schedule<_sha2x8>( p, wk );
+      _sha256_rounds( st, wk      );
+      _sha256_rounds( st, wk + 64 );
+   }
+   SecureZero( wk, sizeof wk );
+
+   if (num) { _sha256_blocks_ssse3( st, p, num ); }
+}
+
+static void _sha512_blocks_avx2( U64 st[8], const BYTE *p, size_t num )
+{
+   U64 wk[2*80];
+   for (; num >= 2; num-=2, p+=2*Sha512Hash::BlockLen) {
+      _sha512_schedule<_sha2x8>( p, wk );
+      _sha512_rounds( st, wk      );
+      _sha512_rounds( st, wk + 80 );
+   }
+   SecureZero( wk, sizeof wk );
+
+   if (num) { _sha512_blocks_ssse3( st, p, num ); }
+}
+#endif
+#endif // JHB_SSSE3
+
+#ifdef JHB_SHANI
+// SHA extensions, SHA-256 only.  Two rounds per SHA256RNDS2, on the state split
+// as ABEF/CDGH; the schedule runs three groups ahead in M[] (SHA256MSG1, 
+// alignr + add, SHA256MSG2).
+#define SHA256_NI_GROUP(g) {                                                                   \
+      __m128i wk = _mm_add_epi32( M[(g)&3], _mm_loadu_si128( (const __m128i *)&_K256[4*(g)] )); \
+      cdgh = _mm_sha256rnds2_epu32( cdgh, abef, wk );                                          \
+      if ((3 <= (g)) && ((g) <= 14)) {                                                         \
+         M[((g)+1)&3] = _mm_add_epi32( M[((g)+1)&3], _mm_alignr_epi8( M[(g)&3], M[((g)-1)&3], 4 )); \
+         M[((g)+1)&3] = _mm_sha256msg2_epu32( M[((g)+1)&3], M[(g)&3] );                       \
+      }                                                                                        \
+      abef = _mm_sha256rnds2_epu32( abef, cdgh, _mm_shuffle_epi32( wk, 0x0e ));                \
+      if ((1 <= (g)) && ((g) <= 12)) { M[((g)-1)&3] = _mm_sha256msg1_epu32( M[((g)-1)&3], M[(g)&3] ); } \
+   }
+
+// Low half of a, high half of b: _mm_blend_epi16( a, b, 0xf0 ) without SSE4.1.
+static inline __m128i _sha256_lohi( __m128i a, __m128i b ) {
+   return _mm_unpacklo_epi64( a, _mm_unpackhi_epi64( b, b ));
+}
+
+static void _sha256_blocks_shani( UINT st[8], const BYTE *p, size_t num )
+{
+   const __m128i bswap = _mm_set_epi8( 12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3 );
+
+   __m128i dcba = _mm_loadu_si128( (const __m128i *)&st[0] );
+   __m128i hgfe = _mm_loadu_si128( (const __m128i *)&st[4] );
+   __m128i badc = _mm_shuffle_epi32( dcba, 0xb1 );
+   __m128i efgh = _mm_shuffle_epi32( hgfe, 0x1b );
+   __m128i abef = _mm_alignr_epi8( badc, efgh, 8 );
+   __m128i cdgh = _sha256_lohi( efgh, badc );
+   __m128i M[4];
+
+   for (; num; num--, p+=Sha256Hash::BlockLen) {
+      __m128i abef0 = abef, cdgh0 = cdgh;
+
+      for (int i=0; i<4; i++) {
+         M[i] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)(p + 16*i) ), bswap );
+      }
+
+      SHA256_NI_GROUP(  0 ); SHA256_NI_GROUP(  1 ); SHA256_NI_GROUP(  2 ); SHA256_NI_GROUP(  3 );
+      SHA256_NI_GROUP(  4 ); SHA256_NI_GROUP(  5 ); SHA256_NI_GROUP(  6 ); SHA256_NI_GROUP(  7 );
+      SHA256_NI_GROUP(  8 ); SHA256_NI_GROUP(  9 ); SHA256_NI_GROUP( 10 ); SHA256_NI_GROUP( 11 );
+      SHA256_NI_GROUP( 12 ); SHA256_NI_GROUP( 13 ); SHA256_NI_GROUP( 14 ); SHA256_NI_GROUP( 15 );
+
+      abef = _mm_add_epi32( abef, abef0 );
+      cdgh = _mm_add_epi32( cdgh, cdgh0 );
+   }
+
+   __m128i feba = _mm_shuffle_epi32( abef, 0x1b );
+   __m128i dchg = _mm_shuffle_epi32( cdgh, 0xb1 );
+   _mm_storeu_si128( (__m128i *)&st[0], _sha256_lohi( feba, dchg ));
+   _mm_storeu_si128( (__m128i *)&st[4], _mm_alignr_epi8( dchg, feba, 8 ));
+
+   for (int i=0; i<4; i++) { M[i] = _mm_setzero_si128(); }
+}
+#endif
+
+// Best block functions for this CPU.  (Not cached here: CpuFeatures caches the
+// flags, so this is only a few tests.)
+static _pfnBlocks256 _sha256Blocks()
+{
+   UINT f = CpuFeatures();
+#ifdef JHB_SHANI
+   if ((f & CPU_SHA) && (f & CPU_SSSE3)) { return _sha256_blocks_shani; }
+#endif
+#ifdef JHB_AVX2
+   if (f & CPU_AVX2 ) { return _sha256_blocks_avx2;  }
+#endif
+#ifdef JHB_SSSE3
+   if (f & CPU_SSSE3) { return _sha256_blocks_ssse3; }
+#endif
+   return _sha256_blocks_c;
+}
+
+static _pfnBlocks512 _sha512Blocks()
+{
+   UINT f = CpuFeatures();
+#ifdef JHB_AVX2
+   if (f & CPU_AVX2 ) { return _sha512_blocks_avx2;  }
+#endif
+#ifdef JHB_SSSE3
+   if (f & CPU_SSSE3) { return _sha512_blocks_ssse3; }
+#endif
+   return _sha512_blocks_c;
+}
+
+static void _blocks( Sha256Hash::Ctx *c, const BYTE *p, size_t num ) { _sha256Blocks()( c->h, p, num ); }
+static void _blocks( Sha512Hash::Ctx *c, const BYTE *p, size_t num ) { _sha512Blocks()( c->h, p, num ); }
+
+// --- Running state ----------------------------------------------------------
+//
+// The same Merkle-Damgard buffering for both: whole blocks go straight from
+// the caller's buffer, and only a partial block is copied.
+
+template <class H> static void _update( typename H::Ctx *c, const BYTE *p, size_t cb )
+{
+   c->len += cb;
+   if (0 < c->num) {
+      size_t n = min( cb, (size_t)(H::BlockLen - c->num) );
+      memcpy( c->data + c->num, p, n );
+      c->num += (UINT)n; p += n; cb -= n;
+      if (c->num < H::BlockLen) { return; }
+      _blocks( c, c->data, 1 );
+      c->num = 0;
+   }
+   if (H::BlockLen <= cb) {
+      size_t n = cb / H::BlockLen;
+      _blocks( c, p, n );
+      p += n * H::BlockLen; cb -= n * H::BlockLen;
+   }
+   if (0 < cb) { memcpy( c->data, p, cb ); c->num = (UINT)cb; }
+}
+
+// Pads with 0x80, zeros and the bit length (8 bytes for SHA-256, 16 for SHA-512),
+// then writes the chaining words big-endian.
+template <class H> static BYTE *_final( typename H::Ctx *c, BYTE *out )
+{
+   const int W = sizeof c->h[0];          // word size; the length field is 2*W bytes
+   const int B = H::BlockLen;
+
+   c->data[c->num++] = 0x80;
+   if (B - 2*W < (int)c->num) {
+      memset( c->data + c->num, 0, B - c->num );
+      _blocks( c, c->data, 1 );
+      c->num = 0;
+   }
+   memset( c->data + c->num, 0, B - c->num );
+   U64 bits = c->len << 3;
+   for (int i=0; i<8; i++) { c->data[B-1-i] = (BYTE)(bits >> (8*i)); }
+   if (8 == W) { c->data[B-9] = (BYTE)(c->len >> 61); }   // SHA-512: bits 64 and up
+   _blocks( c, c->data, 1 );
+
+   for (int i=0; i<H::HashLen; i++) { out[i] = (BYTE)(c->h[i / W] >> (8 * (W - 1 - i % W))); }
+   SecureZero( c, sizeof *c );
+   return out;
+}
+
+// --- Traits -----------------------------------------------------------------
+
+void Sha256Hash::Init( Ctx *c ) {
+   static const UINT iv[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                               0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+   memcpy( c->h, iv, sizeof iv );
+   c->len = 0;
+   c->num = 0;
+}
+void  Sha256Hash::Update( Ctx *c, const BYTE *p, size_t cb ) { _update<Sha256Hash>( c, p, cb ); }
+BYTE *Sha256Hash::Final ( Ctx *c, BYTE *out )                { return _final<Sha256Hash>( c, out ); }
+void  Sha256Hash::Chain ( const Ctx *c, Word h[Words] )      { memcpy( h, c->h, sizeof c->h ); }
+Sha256Hash::pfnBlocks Sha256Hash::Blocks() { return _sha256Blocks(); }
+
+void Sha512Hash::Init( Ctx *c ) {
+   static const U64 iv[8] = { 0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+                              0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL };
+   memcpy( c->h, iv, sizeof iv );
+   c->len = 0;
+   c->num = 0;
+}
+void  Sha512Hash::Update( Ctx *c, const BYTE *p, size_t cb ) { _update<Sha512Hash>( c, p, cb ); }
+BYTE *Sha512Hash::Final ( Ctx *c, BYTE *out )                { return _final<Sha512Hash>( c, out ); }
+void  Sha512Hash::Chain ( const Ctx *c, Word h[Words] )      { memcpy( h, c->h, sizeof c->h ); }
+Sha512Hash::pfnBlocks Sha512Hash::Blocks() { return _sha512Blocks(); }
+
+// --- Public members ---------------------------------------------------------
+
+BYTE *sha256( const BYTE *p, int cb, BYTE *pOut ) {
+   Sha256Hash::Ctx c;
+   Sha256Hash::Init  ( &c );
+   Sha256Hash::Update( &c, p, cb );
+   return Sha256Hash::Final( &c, pOut );
+}
+
+BYTE *sha512( const BYTE *p, int cb, BYTE *pOut ) {
+   Sha512Hash::Ctx c;
+   Sha512Hash::Init  ( &c );
+   Sha512Hash::Update( &c, p, cb );
+   return Sha512Hash::Final( &c, pOut );
+}
+
+// --- HashCtxT ---------------------------------------------------------------
+
+template <class H> static typename H::Ctx *_hashCtx( const MemBuf &m ) { return (typename H::Ctx *)m.ptr(); }
+
+template <class H> HashCtxT<H>::HashCtxT() : _ctx( H::CtxLen ) { Reset(); }
+
+template <class H> HashCtxT<H>::HashCtxT( const HashCtxT &src ) : _ctx( H::CtxLen ) { src.Clone( *this ); }
+
+template <class H> HashCtxT<H> &HashCtxT<H>::operator=( const HashCtxT &src ) { src.Clone( *this ); return *this; }
+
+template <class H> void HashCtxT<H>::Clone( HashCtxT &dst ) const {
+   if (&dst != this) { memcpy( _hashCtx<H>( dst._ctx ), _hashCtx<H>( _ctx ), H::CtxLen ); }
+}
+
+template <class H> void HashCtxT<H>::Reset() { H::Init( _hashCtx<H>( _ctx )); }
+
+template <class H> void HashCtxT<H>::Update( const BYTE *in, int inlen ) { H::Update( _hashCtx<H>( _ctx ), in, inlen ); }
+
+template <class H> BYTE *HashCtxT<H>::Final( BYTE *out ) {
+   H::Final( _hashCtx<H>( _ctx ), out );
+   Reset();
+   return out;
+}
+
+template class HashCtxT<Sha256Hash>;
+template class HashCtxT<Sha512Hash>;
+
+// ----------------------------------------------------------------------------
+
+bool sha2_TEST() {
+
+   // FIPS 180 examples: one block, two blocks, and a million a's.
+   static const struct { char *msg; int repeat; char *sha256, *sha512; } v[] = {
+      { "abc", 1,
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+        "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+        "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f" },
+      { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+        NULL },
+      { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", 1,
+        NULL,
+        "8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018"
+        "501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909" },
+      { "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 10000,
+        "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+        "e718483d0ce769644e2e42c7bc15b4638e1f98b13b2044285632a803afa973eb"
+        "de0ff244877ea60a4cb0432ce577c31beb009c5c2c49aa2e4eadb217ad8cc09b" },
+   };
+   BYTE ref[SHA512_LEN], out[SHA512_LEN];
+   for (int i=0; i<NELEM(v); i++) {
+      Sha256Ctx c256;
+      Sha512Ctx c512;
+      for (int r=0; r<v[i].repeat; r++) {
+         c256.Update( (BYTE*)v[i].msg, (int)strlen(v[i].msg) );
+         c512.Update( (BYTE*)v[i].msg, (int)strlen(v[i].msg) );
+      }
+      if (v[i].sha256) {
+         CvtHex( v[i].sha256, ref );
+         if (0 != memcmp( ref, c256.Final( out ), SHA256_LEN )) { return false; }
+         if ((1 == v[i].repeat) && (0 != memcmp( ref, sha256( (BYTE*)v[i].msg, (int)strlen(v[i].msg), out ), SHA256_LEN ))) { return false; }
+      }
+      if (v[i].sha512) {
+         CvtHex( v[i].sha512, ref );
+         if (0 != memcmp( ref, c512.Final( out ), SHA512_LEN )) { return false; }
+         if ((1 == v[i].repeat) && (0 != memcmp( ref, sha512( (BYTE*)v[i].msg, (int)strlen(v[i].msg), out ), SHA512_LEN ))) { return false; }
+      }
+   }
+
+   // Each block function this CPU can run must agree with the portable one, 
+   // including an odd block count after AVX2's pairs.
+   static BYTE data[5*Sha512Hash::BlockLen];
+   for (int i=0; i<(int)sizeof data; i++) { data[i] = (BYTE)(i*131 + 17); }
+   
+   _pfnBlocks256 pfn256[3] = { 0 };
+   _pfnBlocks512 pfn512[2] = { 0 };
+   UINT f = CpuFeatures();
+#ifdef JHB_SSSE3
+   if (f & CPU_SSSE3) { pfn256[0] = _sha256_blocks_ssse3; pfn512[0] = _sha512_blocks_ssse3; }
+#endif
+#ifdef JHB_AVX2
+   if (f & CPU_AVX2 ) { pfn256[1] = _sha256_blocks_avx2;  pfn512[1] = _sha512_blocks_avx2;  }
+#endif
+#ifdef JHB_SHANI
+   if ((f & CPU_SHA) && (f & CPU_SSSE3)) { pfn256[2] = _sha256_blocks_shani; }
+#endif
+   for (int nb=1; nb<=5; nb++) {
+      for (int i=0; i<NELEM(pfn256); i++) {
+         if (!pfn256[i]) { continue; }
+         UINT h1[8], h2[8];
+         for (int j=0; j<8; j++) { h1[j] = h2[j] = 0x9e3779b9u * (j+1); }
+         _sha256_blocks_c( h1, data, nb );
+         pfn256[i]       ( h2, data, nb );
+         if (0 != memcmp( h1, h2, sizeof h1 )) { return false; }
+      }
+      for (int i=0; i<NELEM(pfn512); i++) {
+         if (!pfn512[i]) { continue; }
+         U64 h1[8], h2[8];
+         for (int j=0; j<8; j++) { h1[j] = h2[j] = 0x9e3779b97f4a7c15ULL * (j+1); }
+         _sha512_blocks_c( h1, data, nb );
+         pfn512[i]       ( h2, data, nb );
+         if (0 != memcmp( h1, h2, sizeof h1 )) { return false; }
+      }
+   }
+
+   // Contexts: uneven pieces around the block and padding boundaries, and a 
+   // fork after a common prefix, against one-shot.
+   for (int len=0; len<=(int)sizeof data; len+=37) {
+      int cb[] = { 1, 54, 9, 64, 119, 128 };
+      Sha256Ctx c256;
+      Sha512Ctx c512;
+      for (int ofs=0, i=0; ofs<len; i=(i+1)%NELEM(cb)) {
+         int n = min( cb[i], len - ofs );
+         c256.Update( data+ofs, n ); c512.Update( data+ofs, n ); ofs += n;
+      }
+      if (0 != memcmp( sha256( data, len, ref ), c256.Final( out ), SHA256_LEN )) { return false; }
+      if (0 != memcmp( sha512( data, len, ref ), c512.Final( out ), SHA512_LEN )) { return false; }
+   }
+   {
+      Sha512Ctx prefix;
+      prefix.Update( data, 200 );
+      Sha512Ctx fork( prefix );
+      prefix.Update( data+200, 20 );
+      fork  .Update( data+200, sizeof data - 200 );
+      if (0 != memcmp( sha512( data, 220, ref ), prefix.Final( out ), SHA512_LEN )) { return false; }
+      if (0 != memcmp( sha512( data, sizeof data, ref ), fork.Final( out ), SHA512_LEN )) { return false; }
+   }
+   
+   // Through the generic, pfnHash form of HMAC (RFC 4231 test case 2).
+   CvtHex( "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843", ref );
+   if (0 != memcmp( ref, hmac( "what do ya want for nothing?", "Jefe", out, sha256, SHA256_LEN ), SHA256_LEN )) { return false; }
+   CvtHex( "164b7a7bfcf819e2e395fbe73b56e0a387bd64222e831fd610270cd7ea250554"
+           "9758bf75c05a994a6d034f65f8f0e6fdcaeab1a34d4a6b4b636e070a38bce737", ref );
+   if (0 != memcmp( ref, hmac( "what do ya want for nothing?", "Jefe", out, sha512, SHA512_LEN ), SHA512_LEN )) { return false; }
+   
+   return true;
+}
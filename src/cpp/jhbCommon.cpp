@@ -220,6 +220,48 @@ void CycleLogFiles( const char *filename, int maxCount, int maxLength ) {
    rename( filename, next.c_str() ); 
 }
 
+// ----------------------------------------------------------------------------
+// Number of processors available to run worker threads.
+// ----------------------------------------------------------------------------
+int CpuCount() {
+   SYSTEM_INFO si; GetSystemInfo( &si );
+   return max( 1, (int)si.dwNumberOfProcessors );
+}
+
+// ----------------------------------------------------------------------------
+// Fork/join helper.  Worker n-1 runs on the calling thread.  If a thread can't 
+// be created, its worker runs on the calling thread as well, so all n always 
+// get done.
+// ----------------------------------------------------------------------------
+struct _worker_t { pfnWorker pfn; void *ctx; int i; };
+
+static DWORD WINAPI _workerThread( LPVOID lpParameter ) {
+   _worker_t *w = (_worker_t *)lpParameter;
+   w->pfn( w->ctx, w->i );
+   return 0;
+}
+
+void RunWorkers( int n, pfnWorker pfn, void *ctx ) {
+
+   if (n <= 0) { return; }
+   
+   std::vector<_worker_t> w( n );
+   std::vector<HANDLE>    h( n, (HANDLE)0 );
+   
+   for (int i=0; i<n; i++) {
+      w[i].pfn = pfn; w[i].ctx = ctx; w[i].i = i;
+   }
+   for (int i=0; i<(n-1); i++) {
+      h[i] = CreateThread( 0, 0, _workerThread, &w[i], 0, 0 );
+      if (0 == h[i]) { _workerThread( &w[i] ); }
+   }
+   _workerThread( &w[n-1] );
+
+   for (int i=0; i<(n-1); i++) {
+      if (h[i]) { WaitForSingleObject( h[i], INFINITE ); CloseHandle( h[i] ); }
+   }
+}
+
 // --- RegKey -----------------------------------------------------------------
 
 /*
@@ -107,6 +107,13 @@ int ReadBinaryFile( const wchar_t *filePath, BYTE *p, size_t cb );
 
 void CycleLogFiles( const char *filename, int maxCount, int maxLength );
 
+// Simple fork/join: runs pfn( ctx, i ) for i = 0..n-1, each on its own thread, 
+// and returns when all of them are done.
+typedef void (* pfnWorker)( void *ctx, int i );
+
+int  CpuCount  ();
+void RunWorkers( int n, pfnWorker pfn, void *ctx );
+
 // ----------------------------------------------------------------------------
 //
 // Template Functions
@@ -39,15 +39,91 @@
 
 //#include <time.h>
 #include "jhbKrypto.h"
+#include "jhb_simd.h"
+#include "jhb_aes.h"
 
 extern "C" {
    #include <openssl/aes.h>
    #include <openssl/modes/modes_lcl.h>
 
+   // SHA1_ASM: the block function, sha1_block_data_order(), comes from SHA1.cpp, which 
+   // picks an SSSE3/AVX2/SHA-extension version at run time.
    #define SHA_1
+   #define SHA1_ASM
    #include <openssl/sha_locl.h>   
 }   
    
+// --------------------------------------------------------------------------------------
+// Reports the CPU features that the accelerated code paths care about. 
+// (Computed once; the CPUID instruction is slow.)
+// --------------------------------------------------------------------------------------
+#ifdef JHB_X86
+// CPUID leaf and subleaf into r (EAX, EBX, ECX, EDX); XCR0.  (gcc's cpuid.h has a 
+// different __cpuid, and its _xgetbv needs -mxsave.)
+static void _cpuid( int r[4], int leaf, int sub ) {
+#ifdef _MSC_VER
+   __cpuidex( r, leaf, sub );
+#else
+   __cpuid_count( leaf, sub, r[0], r[1], r[2], r[3] );
+#endif
+}
+
+#ifdef JHB_AVX2
+static unsigned __int64 _xcr0() {
+#ifdef _MSC_VER
+   return _xgetbv( 0 );
+#else
+   UINT lo, hi;
+   __asm__ __volatile__( "xgetbv" : "=a" (lo), "=d" (hi) : "c" (0) );
+   return ((unsigned __int64)hi << 32) | lo;
+#endif
+}
+#endif // JHB_AVX2
+#endif // JHB_X86
+
+static UINT _cpuFeatures() {
+   UINT f = 0;
+#ifdef JHB_X86
+   int r[4];
+   _cpuid( r, 0, 0 );
+   int maxLeaf = r[0];
+   
+   _cpuid( r, 1, 0 );
+   if (r[3] & (1 << 26)) { f |= CPU_SSE2  ; }
+   if (r[2] & (1 <<  9)) { f |= CPU_SSSE3 ; }
+   if (r[2] & (1 << 25)) { f |= CPU_AESNI ; }
+   if (r[2] & (1 <<  1)) { f |= CPU_PCLMUL; }
+   
+   // AVX2 also needs the OS to save the YMM registers (OSXSAVE and XCR0).
+   bool bYmm = false;
+   #ifdef JHB_AVX2
+   bYmm = (r[2] & (1 << 27)) && (r[2] & (1 << 28)) && (6 == (_xcr0() & 6));
+   #endif
+   
+   if (7 <= maxLeaf) {
+      _cpuid( r, 7, 0 );
+      if (bYmm && (r[1] & (1 <<  5))) { f |= CPU_AVX2; }
+      if (        (r[1] & (1 << 29))) { f |= CPU_SHA ; }
+   }
+#endif   
+   return f;
+}
+
+// The flags, with CPU_KNOWN set once computed (so a CPU with none of the features is 
+// cached too).  Not a function-local static: initializing one is not thread-safe on 
+// older compilers.  Racing first calls compute and store the same value.
+#define CPU_KNOWN   0x40000000
+static volatile LONG _cpuFlags = 0;
+
+UINT CpuFeatures() {
+   LONG f = _cpuFlags;
+   if (0 == f) {
+      f = (LONG)(_cpuFeatures() | CPU_KNOWN);
+      InterlockedExchange( &_cpuFlags, f );
+   }
+   return (UINT)f & ~CPU_KNOWN;
+}
+
 // --------------------------------------------------------------------------------------
 // Rounds up the given length to a multiple of the block size, including 
 // adding an extra block when necessary.
@@ -100,19 +176,104 @@ BYTE* sha1( const BYTE *p, int cb, BYTE *pOut ) {
 }
 
 // ----------------------------------------------------------------------------
-// AES-CBC-128 based on OpenSSL library.
+// AES-CBC (AES-NI when available; see AES.cpp).  NR fixes the key length 
+// here; the AES.cpp loops are themselves instantiated per round count.
 // ----------------------------------------------------------------------------
+template <int NR> 
 BYTE *aes( const BYTE *in, BYTE *out, int cb, const BYTE *key, const BYTE *iv, bool bEncrypt ) {
 
    AES_KEY aks; 
-   bEncrypt ? private_AES_set_encrypt_key( key, AesCbc128_BlkLen * 8, &aks )   
-            : private_AES_set_decrypt_key( key, AesCbc128_BlkLen * 8, &aks ) ;
+   bEncrypt ? aes_set_encrypt_key( key, AesKeyT<NR>::KeyLen * 8, &aks )   
+            : aes_set_decrypt_key( key, AesKeyT<NR>::KeyLen * 8, &aks ) ;
+   
+   aes_cbc_encrypt( in, out, cb, &aks, iv, bEncrypt );
    
-   AES_cbc_encrypt( in, out, cb, &aks, (BYTE *)iv, bEncrypt?1:0 );
+   SecureZero( &aks, sizeof aks );
    
    return out;
 }
 
+// Same, with the key already expanded.
+template <int NR> 
+BYTE *aes( const BYTE *in, BYTE *out, int cb, const AesKeyT<NR> &key, const BYTE *iv, bool bEncrypt ) {
+   aes_cbc_encrypt( in, out, cb, aes_schedule( key, bEncrypt ), iv, bEncrypt );
+   return out;
+}
+
+BYTE *aes( const BYTE *in, BYTE *out, int cb, const BYTE *key, const BYTE *iv, bool bEncrypt ) {
+   return aes<Aes128>( in, out, cb, key, iv, bEncrypt );
+}
+
+template BYTE *aes<Aes128>( const BYTE *, BYTE *, int, const BYTE *, const BYTE *, bool );
+template BYTE *aes<Aes192>( const BYTE *, BYTE *, int, const BYTE *, const BYTE *, bool );
+template BYTE *aes<Aes256>( const BYTE *, BYTE *, int, const BYTE *, const BYTE *, bool );
+template BYTE *aes<Aes128>( const BYTE *, BYTE *, int, const AesKeyT<Aes128> &, const BYTE *, bool );
+template BYTE *aes<Aes192>( const BYTE *, BYTE *, int, const AesKeyT<Aes192> &, const BYTE *, bool );
+template BYTE *aes<Aes256>( const BYTE *, BYTE *, int, const AesKeyT<Aes256> &, const BYTE *, bool );
+
+// ----------------------------------------------------------------------------
+// AES-CTR.  Counter blocks are independent, so a large buffer is cut into
+// whole-block ranges, one per worker, each starting at its own block offset.
+// ----------------------------------------------------------------------------
+#define AES_CTR_MIN_PER_THREAD (256 * 1024)   // smaller pieces aren't worth a thread
+
+struct _aes_ctr_job_t {
+   const BYTE    *in;
+   BYTE          *out;
+   size_t         cb;
+   const AES_KEY *ks;
+   const BYTE    *ctr;
+   size_t         blocksPer;   // whole blocks per worker; the last takes the rest
+   int            workers;
+};
+
+static void _aesCtrWorker( void *ctx, int i ) {
+   _aes_ctr_job_t *job = (_aes_ctr_job_t *)ctx;
+   size_t first = job->blocksPer * i * AesCbc128_BlkLen;
+   size_t len   = (i == job->workers - 1) ? job->cb - first : job->blocksPer * AesCbc128_BlkLen;
+   aes_ctr_encrypt( job->in + first, job->out + first, len, job->ks, job->ctr, job->blocksPer * i );
+}
+
+static void _aesCtr( const BYTE *in, BYTE *out, size_t cb, const AES_KEY *ks, const BYTE *ctr, int nThreads ) {
+
+   size_t maxWorkers = max( (size_t)1, cb / AES_CTR_MIN_PER_THREAD );
+   int    workers    = (int)min( maxWorkers, (size_t)((0 == nThreads) ? CpuCount() : max( 1, nThreads )));
+
+   if (1 == workers) { aes_ctr_encrypt( in, out, cb, ks, ctr, 0 ); return; }
+
+   _aes_ctr_job_t job = { in, out, cb, ks, ctr, (cb / AesCbc128_BlkLen) / workers, workers };
+   RunWorkers( workers, _aesCtrWorker, &job );
+}
+
+template <int NR> 
+BYTE *aes_ctr( const BYTE *in, BYTE *out, size_t cb, const BYTE *key, const BYTE *ctr, int nThreads ) {
+
+   AES_KEY aks; 
+   aes_set_encrypt_key( key, AesKeyT<NR>::KeyLen * 8, &aks );
+   _aesCtr( in, out, cb, &aks, ctr, nThreads );
+   SecureZero( &aks, sizeof aks );
+   
+   return out;
+}
+
+// Same, with the key already expanded.
+template <int NR> 
+BYTE *aes_ctr( const BYTE *in, BYTE *out, size_t cb, const AesKeyT<NR> &key, const BYTE *ctr, int nThreads ) {
+   _aesCtr( in, out, cb, aes_schedule( key, true ), ctr, nThreads );
+   return out;
+}
+
+BYTE *aes_ctr( const BYTE *in, BYTE *out, size_t cb, const BYTE *key, const BYTE *ctr, int nThreads ) {
+   return aes_ctr<Aes128>( in, out, cb, key, ctr, nThreads );
+}
+
+template BYTE *aes_ctr<Aes128>( const BYTE *, BYTE *, size_t, const BYTE *, const BYTE *, int );
+template BYTE *aes_ctr<Aes192>( const BYTE *, BYTE *, size_t, const BYTE *, const BYTE *, int );
+template BYTE *aes_ctr<Aes256>( const BYTE *, BYTE *, size_t, const BYTE *, const BYTE *, int );
+template BYTE *aes_ctr<Aes128>( const BYTE *, BYTE *, size_t, const AesKeyT<Aes128> &, const BYTE *, int );
+template BYTE *aes_ctr<Aes192>( const BYTE *, BYTE *, size_t, const AesKeyT<Aes192> &, const BYTE *, int );
+template BYTE *aes_ctr<Aes256>( const BYTE *, BYTE *, size_t, const AesKeyT<Aes256> &, const BYTE *, int );
+
 // ----------------------------------------------------------------------------
 // Creates an arbitrarily long hash stream from the given seed.
 // ----------------------------------------------------------------------------
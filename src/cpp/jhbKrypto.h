@@ -45,6 +45,16 @@
 //
 // ======================================================================================
 
+// CPU features, for picking accelerated code paths at run time.
+#define CPU_SSE2    0x0001
+#define CPU_SSSE3   0x0002
+#define CPU_AVX2    0x0004
+#define CPU_AESNI   0x0008
+#define CPU_PCLMUL  0x0010
+#define CPU_SHA     0x0020
+
+UINT CpuFeatures();
+
 // Pad byte utilities.
 int  PadLen     ( int ptLen, int blocksize           ) ;
 void PadWrite   ( int ptLen, int blocksize, BYTE *pt ) ;
@@ -54,8 +64,37 @@ int  PadCheckGet( BYTE *ct, int ctLen, bool bClear = false ) ;
 #define SHA1_LEN 20
 BYTE *sha1( const BYTE *p, int cb, BYTE *pOut );
 
-// AES-CBC-128
+// SHA-2 (SHA2.cpp).  Incremental: Sha256Ctx, Sha512Ctx.
+#define SHA256_LEN 32
+#define SHA512_LEN 64
+BYTE *sha256( const BYTE *p, int cb, BYTE *pOut );
+BYTE *sha512( const BYTE *p, int cb, BYTE *pOut );
+
+// AES key sizes, as template arguments: the number of rounds.  Each size gets its own 
+// compiled loops, so nothing tests the key size per block.
+enum { Aes128 = 10, Aes192 = 12, Aes256 = 14 };
+
+template <int NR> class AesKeyT;
+typedef AesKeyT<Aes128> AesKey;
+
+// AES-CBC: AES-128, or the key size given, e.g. aes<Aes256>( in, out, cb, key32, iv, true ).
+// -- the AesKeyT form skips key expansion; use it for many messages under one key
 BYTE *aes( const BYTE *in, BYTE *out, int cb, const BYTE *key, const BYTE *iv, bool bEncrypt );
+template <int NR> 
+BYTE *aes( const BYTE *in, BYTE *out, int cb, const BYTE *key, const BYTE *iv, bool bEncrypt );
+template <int NR> 
+BYTE *aes( const BYTE *in, BYTE *out, int cb, const AesKeyT<NR> &key, const BYTE *iv, bool bEncrypt );
+
+// AES-CTR (SP 800-38A), key sizes as for aes(); the same call encrypts and decrypts.  ctr is the initial 16-byte 
+// counter block, incremented as one big-endian number, and is not modified.  Never reuse a 
+// counter range under the same key.
+// -- nThreads: 1 runs on the calling thread, N uses up to N threads, 0 up to one per CPU.
+//    Buffers are only split in pieces of 256 KB or more.
+BYTE *aes_ctr( const BYTE *in, BYTE *out, size_t cb, const BYTE *key, const BYTE *ctr, int nThreads = 0 );
+template <int NR> 
+BYTE *aes_ctr( const BYTE *in, BYTE *out, size_t cb, const BYTE *key, const BYTE *ctr, int nThreads = 0 );
+template <int NR> 
+BYTE *aes_ctr( const BYTE *in, BYTE *out, size_t cb, const AesKeyT<NR> &key, const BYTE *ctr, int nThreads = 0 );
 
 
 // Psuedo-random byte stream generators
@@ -66,6 +105,42 @@ BYTE *GenKeyBytes( KeyBuf &kb, const BYTE *seed, int cbSeed );
 BYTE *GenKeyBytes( KeyBuf &kb ); 
 
 
+// ------------
+// From AES.cpp
+// ------------
+
+bool aes_TEST();
+
+// -------------
+// From SHA1.cpp
+// -------------
+
+// Multi-lane SHA-1 compression: h_out = h_in + compress( h_in, W ) for 'lanes' independent
+// states at once, in SIMD lanes where the CPU has them.  Arrays are word-interleaved: word 
+// j of lane k is at [j*lanes + k].
+// -- h_in : 5 chaining words per lane
+// -- W    : 16 message words per lane (big-endian decoded)
+// -- h_out: 5 words per lane; may alias h_in or the first 5 words of W
+// -- lanes: 1, 4 or 8.  sha1_lanes() returns the widest the CPU runs natively.
+int  sha1_lanes     ();
+void sha1_compress_x( const UINT *h_in, const UINT *W, UINT *h_out, int lanes );
+
+// Multi-buffer SHA-1: out[i] = sha1( msgs[i], lens[i] ) for i in [0,n).  Interleaves the 
+// messages across SIMD lanes; falls back to plain sha1() on CPUs without them.  Best for 
+// many small messages.
+// -- h0, done: message i picks up from chaining values h0[i], as if 'done' bytes (a 
+//    multiple of 64) were already hashed; e.g. HMAC's key block.  NULL: a fresh hash.
+void sha1_multi( const BYTE * const msgs[], const int lens[], BYTE * const outs[], int n, 
+                 const UINT h0[][5] = NULL, int done = 0 );
+
+bool sha1_TEST();
+
+// -------------
+// From SHA2.cpp
+// -------------
+
+bool sha2_TEST();
+
 // -------------
 // From HMAC.cpp
 // -------------
@@ -82,23 +157,105 @@ BYTE* hmac_sha1( LPCSTR in           , PCBYTE key, int keylen, BYTE* out );
 BYTE* hmac_sha1( PCBYTE in, int inlen, LPCSTR key,             BYTE* out );
 BYTE* hmac_sha1( LPCSTR in           , LPCSTR key,             BYTE* out );
 
+// HMAC over any hash with traits (see Sha1Hash); the key block is H::BlockLen bytes, so 
+// 128-byte-block hashes come out right too.  The hmac_shaX forms are instantiations.
+template <class H> 
+BYTE* hmacT      ( PCBYTE in, int inlen, PCBYTE key, int keylen, BYTE* out );
+BYTE* hmac_sha256( PCBYTE in, int inlen, PCBYTE key, int keylen, BYTE* out );
+BYTE* hmac_sha512( PCBYTE in, int inlen, PCBYTE key, int keylen, BYTE* out );
+
+// Batched HMAC-SHA1 over many (typically small) messages.  The MACs are interleaved across 
+// SIMD lanes (see sha1_multi) and spread across threads (nThreads as for PBKDF2; default 
+// one per CPU).
+// -- each entry has its key as a shared HmacSha1Key (quickest: its midstates are reused 
+//    as they are) or, when ctx is NULL, as raw bytes
+// -- hmac_sha1_sign writes entry i's MAC to out[i]
+// -- hmac_sha1_verify checks the first taglen (1..SHA1_LEN) bytes of each MAC against the 
+//    entry's tag, in constant time, and sets bit (i % 8) of pass[i / 8] if they match.  
+//    pass is (n + 7) / 8 bytes; unused bits are cleared.  Returns the number that matched.
+template <class H> class HmacKeyT;
+struct Sha1Hash;
+typedef HmacKeyT<Sha1Hash> HmacSha1Key;
+
+struct HmacSha1In_t {
+   const BYTE        *msg;
+   int                msglen;
+   const HmacSha1Key *ctx;
+   const BYTE        *key;
+   int                keylen;
+   const BYTE        *tag;        // expected MAC; verify only
+};
+void hmac_sha1_sign  ( const HmacSha1In_t in[], BYTE out[][SHA1_LEN], int n, int nThreads = 0 );
+int  hmac_sha1_verify( const HmacSha1In_t in[], int taglen, BYTE *pass, int n, int nThreads = 0 );
+
 bool hmac_TEST();
 
 // -------------
 // From CMAC.cpp
 // -------------
 
+// Other key sizes: CmacAes192/256 (below).
 BYTE* cmac_aes128( PCBYTE in, int inlen, PCBYTE key, int keylen, BYTE* out );
 
 bool cmac_TEST();
 
+// ------------------
+// From Container.cpp
+// ------------------
+
+bool container_TEST();
+
+// ------------
+// From GCM.cpp
+// ------------
+
+// AES-GCM-128 (NIST SP 800-38D): encrypts and authenticates in one pass.  Decryption 
+// returns false, and zeroes out, if the tag does not match.
+// -- nonce: AesGcm_NonceLen bytes; never use one twice under the same key
+// -- aad  : authenticated, not encrypted; may be NULL when aadlen is 0
+// -- in may equal out
+#define AesGcm_NonceLen 12
+#define AesGcm_TagLen   16
+
+BYTE *aes_gcm_encrypt( const BYTE *in, BYTE *out, size_t cb, const BYTE   *key, const BYTE *nonce, 
+                       const BYTE *aad, size_t aadlen, BYTE *tag );
+BYTE *aes_gcm_encrypt( const BYTE *in, BYTE *out, size_t cb, const AesKey &key, const BYTE *nonce, 
+                       const BYTE *aad, size_t aadlen, BYTE *tag );
+bool  aes_gcm_decrypt( const BYTE *in, BYTE *out, size_t cb, const BYTE   *key, const BYTE *nonce, 
+                       const BYTE *aad, size_t aadlen, const BYTE *tag );
+bool  aes_gcm_decrypt( const BYTE *in, BYTE *out, size_t cb, const AesKey &key, const BYTE *nonce, 
+                       const BYTE *aad, size_t aadlen, const BYTE *tag );
+
+bool gcm_TEST();
+
 // ----------------
 // From PBKDFF2.cpp
 // ----------------
 
+// nThreads: 1 = serial, N = up to N worker threads, 0 = up to one per CPU.
+BYTE *PBKDF2( PCBYTE text, int textlen, PCBYTE salt, int saltlen, int count, int length, BYTE *out, int nThreads = 1 );
 BYTE *PBKDF2( const MemBuf &text, const MemBuf &salt, int count, int length, MemBuf &out);
 BYTE *PBKDF2( const char   *text, const char   *salt, int count, int length, MemBuf &out); 
 
+// PRF HMAC-SHA256 / HMAC-SHA512 (RFC 8018), otherwise as above.  One template core 
+// (PBKDF2T, over hash traits such as Sha256Hash) serves all three PRFs.  A 32-byte 
+// key is one PRF block for either, where SHA-1 needs two.
+BYTE *PBKDF2_sha256( PCBYTE text, int textlen, PCBYTE salt, int saltlen, int count, int length, BYTE *out, int nThreads = 1 );
+BYTE *PBKDF2_sha512( PCBYTE text, int textlen, PCBYTE salt, int saltlen, int count, int length, BYTE *out, int nThreads = 1 );
+template <class H>
+BYTE *PBKDF2T      ( PCBYTE text, int textlen, PCBYTE salt, int saltlen, int count, int length, BYTE *out, int nThreads = 1 );
+
+// Iteration count for which PBKDF2 with this PRF takes about 'ms' milliseconds on this 
+// machine, for a 'length'-byte key on nThreads (as for PBKDF2).  The core's speed is 
+// timed (usTimer) on the first call for each PRF, which takes a few tens of ms, and 
+// cached for the life of the process.  Returns at least 1; callers should still apply 
+// their own minimum.
+int PBKDF2_calibrate       ( int ms, int length = SHA1_LEN  , int nThreads = 1 );
+int PBKDF2_calibrate_sha256( int ms, int length = SHA256_LEN, int nThreads = 1 );
+int PBKDF2_calibrate_sha512( int ms, int length = SHA512_LEN, int nThreads = 1 );
+template <class H>
+int PBKDF2_calibrateT      ( int ms, int length, int nThreads = 1 );
+
 bool PBKDF2_TEST();
 
 
@@ -111,6 +268,17 @@ BYTE *WPAPSK(PCBYTE text, int len, PCBYTE ssid, int ssidlen, BYTE   *out);
 BYTE *WPAPSK(LPCSTR text,          PCBYTE ssid, int ssidlen, MemBuf &out);
 BYTE *WPAPSK(LPCSTR text,          LPCSTR ssid             , MemBuf &out);
 
+// Batch form.  Runs several PBKDF2 chains at once in SIMD lanes (see sha1_lanes) and 
+// spreads them across threads (nThreads as for PBKDF2; default one per CPU).
+// -- returns the number of PSKs computed
+// -- entries whose passphrase length is out of range get an all-zero PSK
+struct WpaPskIn_t { 
+   LPCSTR      passphrase; 
+   const BYTE *ssid; 
+   int         ssidlen; 
+};
+int WPAPSK_batch( const WpaPskIn_t in[], BYTE out[][WPAPSK_LEN], int n, int nThreads = 0 );
+
 bool WPAPSK_TEST();
 
 
@@ -121,9 +289,10 @@ bool WPAPSK_TEST();
 // ======================================================================================
 
 // --------------------------------------------------------------------------------------
-// Ciphertext "package" that includes an IV with the ciphertext.
+// Ciphertext "package" that includes an IV with the ciphertext.  NR only tags the type 
+// with the key size, as elsewhere (Aes128/192/256); the layout depends on BlockSize alone.
 // --------------------------------------------------------------------------------------
-template <int BlockSize> struct _block_cipher_package_t {
+template <int BlockSize, int NR = Aes128> struct _block_cipher_package_t {
 
    typedef BYTE Block[BlockSize];
    
@@ -139,10 +308,367 @@ template <int BlockSize> struct _block_cipher_package_t {
    } 
    
    int blkSize() { return BlockSize; }
+   int keySize() { return 4 * (NR - 6); }   // bytes
 } ;
 
 #define AesCbc128_BlkLen 16
-typedef _block_cipher_package_t<AesCbc128_BlkLen> AesCbc128Pkg_t; 
+typedef _block_cipher_package_t<AesCbc128_BlkLen        > AesCbc128Pkg_t; 
+typedef _block_cipher_package_t<AesCbc128_BlkLen, Aes192> AesCbc192Pkg_t; 
+typedef _block_cipher_package_t<AesCbc128_BlkLen, Aes256> AesCbc256Pkg_t; 
+
+// --------------------------------------------------------------------------------------
+// Authenticated-encryption "package": nonce and tag with the ciphertext.  There is no 
+// padding; the ciphertext is as long as the plaintext.
+// --------------------------------------------------------------------------------------
+template <int NonceSize, int TagSize> struct _aead_package_t {
+
+   BYTE nonce[NonceSize];   // unique per message under one key
+   BYTE tag  [TagSize  ];   // authentication tag
+   BYTE ct   [1];           // array size as needed to fit the ciphertext
+   
+   // For calculating the size of the full structure from a plain text length.
+   static int CalcSize( UINT ptLen ) { return NonceSize + TagSize + ptLen; }
+   
+   // For calculating the size of the ct member from a full structure size.
+   static int ctSize( int size ) { return max( size - NonceSize - TagSize, 0 ); }
+} ;
+
+typedef _aead_package_t<AesGcm_NonceLen, AesGcm_TagLen> AesGcm128Pkg_t; 
+
+
+// --------------------------------------------------------------------------------------
+// AES key context; NR is the key size (Aes128/192/256).  Both expanded key schedules, 
+// encryption and decryption, are built once, at construction, and zeroed on destruction 
+// (they live in a KeyBuf).  Pass it to the aes() overload to process any number of 
+// messages without re-expanding the key.  (From AES.cpp)
+// --------------------------------------------------------------------------------------
+struct aes_key_st;   // OpenSSL's AES_KEY
+
+class _aes_key_t {
+protected:
+   _aes_key_t( const BYTE *key, int bits );
+
+private:
+   KeyBuf _ks;   // two AES_KEY's: encryption, decryption
+   
+   _aes_key_t( const _aes_key_t & );              // not copyable
+   _aes_key_t &operator=( const _aes_key_t & );
+   
+   friend const aes_key_st *aes_schedule( const _aes_key_t &key, bool bEncrypt );
+};
+
+template <int NR> class AesKeyT : public _aes_key_t {
+public:
+   enum { Rounds = NR, KeyLen = 4 * (NR - 6) };
+   
+   AesKeyT( const BYTE *key ) : _aes_key_t( key, KeyLen * 8 ) {}   // key must be KeyLen bytes
+};
+
+typedef AesKeyT<Aes192> Aes192Key;
+typedef AesKeyT<Aes256> Aes256Key;
+
+
+// --------------------------------------------------------------------------------------
+// Incremental SHA-1.  (From SHA1.cpp)
+//
+// -- Update() any number of times, then Final().  Final resets the object.
+// -- copying (or Clone) forks the running state, so a common prefix can be hashed once 
+//    and then finished several ways.
+// -- Save() writes the midstate as StateLen portable bytes and Restore() loads it back, 
+//    so a long hash can be checkpointed and resumed later, even in another process.
+// --------------------------------------------------------------------------------------
+class Sha1Ctx {
+public:
+   enum { HashLen = SHA1_LEN, StateLen = 92 };
+   
+   Sha1Ctx();
+   Sha1Ctx( const Sha1Ctx &src );
+   Sha1Ctx &operator=( const Sha1Ctx &src );
+
+   void  Reset ();
+   void  Update( const BYTE *in, int inlen );
+   BYTE *Final ( BYTE *out );                // out must have room for HashLen bytes
+   
+   void  Clone( Sha1Ctx &dst ) const;
+   
+   BYTE *Save   ( BYTE *out ) const;         // out must have room for StateLen bytes
+   bool  Restore( const BYTE *in, int inlen );
+   
+private:
+   KeyBuf _ctx;   // SHA_CTX
+};
+
+
+// --------------------------------------------------------------------------------------
+// AES-CMAC key context; NR is the key size (Aes128/192/256).  The AES key schedule and 
+// the K1/K2 subkeys are computed once, at construction, so any number of messages can be 
+// MAC'd under the same key without re-expanding it.  (From CMAC.cpp)
+//
+// -- Mac() is one-shot and does not touch the streaming state.
+// -- Init/Update/Final MAC a message that arrives in pieces of any size.  Only one 
+//    pending block is held, so memory use is constant.  Final re-inits the object.
+// --------------------------------------------------------------------------------------
+class _cmac_aes_t {
+public:
+   enum { MacLen = 16 };
+
+   // out must have room for MacLen bytes.
+   BYTE *Mac( const BYTE *in, int inlen, BYTE *out ) const;
+   
+   void  Init  ();
+   void  Update( const BYTE *in, int inlen );
+   BYTE *Final ( BYTE *out );
+   
+protected:
+   _cmac_aes_t( const BYTE *key, int bits );
+
+private:
+   KeyBuf             _ks;       // expanded AES encryption key schedule
+   BlockBuf<MacLen>   _K1, _K2;  // subkeys
+   
+   BlockBuf<MacLen>   _X;        // CBC-MAC chaining value
+   BlockBuf<MacLen>   _M;        // pending block (becomes M_last at Final)
+   int                _n;        // number of bytes in _M
+
+   _cmac_aes_t( const _cmac_aes_t & );            // not copyable
+   _cmac_aes_t &operator=( const _cmac_aes_t & );
+};
+
+template <int NR> class CmacAesT : public _cmac_aes_t {
+public:
+   enum { KeyLen = 4 * (NR - 6) };
+
+   CmacAesT( const BYTE *key ) : _cmac_aes_t( key, KeyLen * 8 ) {}   // key must be KeyLen bytes
+};
+
+typedef CmacAesT<Aes128> CmacAes128;
+typedef CmacAesT<Aes192> CmacAes192;
+typedef CmacAesT<Aes256> CmacAes256;
+
+
+// --------------------------------------------------------------------------------------
+// AES-CBC-128 encrypt-then-MAC with CMAC-AES128, in one pass.  Seal() writes the IV and
+// ciphertext as an AesCbc128Pkg_t, then the tag right after the ciphertext; each block 
+// is MAC'd as it is encrypted, while still in L1, rather than in a second pass over the
+// package.  Open() likewise decrypts a few KB behind the MAC, and checks the tag before
+// it looks at the padding.  (From CMAC.cpp)
+//
+// -- the tag covers the IV and all of the ciphertext
+// -- the two keys must be independent of each other
+// -- pt may be pkg->ct, for Seal and for Open
+// --------------------------------------------------------------------------------------
+class AesCbcCmac128 {
+public:
+   enum { KeyLen = 16, TagLen = 16 };
+
+   AesCbcCmac128( const BYTE *encKey, const BYTE *macKey );   // KeyLen bytes each
+
+   // Full size of a sealed package, tag included, from a plain text length.
+   static int CalcSize( int ptLen ) { return AesCbc128Pkg_t::CalcSize( ptLen ) + TagLen; }
+
+   // pkg must have room for CalcSize( ptLen ) bytes; returns that size.  iv is 
+   // AesCbc128_BlkLen bytes, and must be unpredictable (random) for each package.
+   int Seal( const BYTE *pt, int ptLen, const BYTE *iv, AesCbc128Pkg_t *pkg ) const;
+   
+   // size is the full package size.  pt needs room for the plain text only, which is at 
+   // most size - TagLen - AesCbc128_BlkLen - 1 bytes.  Returns the plain text length, or 
+   // -1 (with pt zeroed) if the tag or the padding is bad.
+   int Open( const AesCbc128Pkg_t *pkg, int size, BYTE *pt ) const;
+
+private:
+   AesKey             _enc;   // CBC schedules
+   KeyBuf             _mks;   // MAC key's AES encryption schedule
+   BlockBuf<TagLen>   _K1;    // CMAC subkey (the MAC input is always whole blocks)
+};
+
+
+// --------------------------------------------------------------------------------------
+// Chunked AES-CBC + CMAC container, for random access to large encrypted data.  The plain
+// text is cut into fixed-size chunks, each sealed on its own by AesCbcCmac128, after a 
+// HeaderLen-byte header.  Any one chunk can be found, checked and decrypted in time 
+// proportional to the chunk size, and chunks can be done in parallel.  (From Container.cpp)
+//
+// -- the header holds the layout (chunk length, plain text length) and a random nonce, 
+//    under its own CMAC tag.  Chunks are fixed-size, so it is also the index: chunk i 
+//    starts at ChunkOffset( i ).
+// -- chunk i's IV is derived from the nonce and i, and checked on Open, so a chunk only 
+//    opens in its own place in its own container
+// -- Create() or ReadHeader() sets the layout.  After that the object is only read, and
+//    any number of threads may seal or open chunks at once.
+// --------------------------------------------------------------------------------------
+class AesChunked128 {
+public:
+   enum { HeaderLen   = 64, 
+          NonceLen    = 16, 
+          DefChunkLen = 64 * 1024, 
+          MaxChunkLen = 16 * 1024 * 1024 };
+
+   AesChunked128( const BYTE *encKey, const BYTE *macKey );   // AesCbcCmac128::KeyLen bytes each
+
+   // A new container.  chunkLen: 1..MaxChunkLen, else false (and nothing changes).  
+   // nonce: NonceLen random bytes, new for every container.  The header (HeaderLen 
+   // bytes) goes to hdr, if not NULL.
+   bool Create( unsigned __int64 ptLen, int chunkLen, const BYTE *nonce, BYTE *hdr );
+
+   // An existing container: checks the header's tag and takes the layout from it.
+   bool ReadHeader( const BYTE *hdr );
+
+   // The nonce in a header, unchecked: for deriving the keys (as a salt) before there 
+   // is a key to check the header with.
+   static const BYTE *HeaderNonce( const BYTE *hdr );
+
+   // Layout.
+   unsigned __int64 PtLen      () const { return _ptLen;    }
+   int              ChunkLen   () const { return _chunkLen; }
+   unsigned __int64 Chunks     () const;
+   unsigned __int64 Size       () const;                       // all of it, header included
+   int              ChunkPtLen ( unsigned __int64 i ) const;   // plain text in chunk i
+   int              ChunkPkgLen( unsigned __int64 i ) const;   // chunk i, sealed
+   unsigned __int64 ChunkOffset( unsigned __int64 i ) const;   // from the container start
+
+   // One chunk.  pt is ChunkPtLen( i ) bytes, out and pkg ChunkPkgLen( i ).  OpenChunk 
+   // returns false, with pt zeroed, if the chunk doesn't check out.
+   void SealChunk( unsigned __int64 i, const BYTE *pt , BYTE *out ) const;
+   bool OpenChunk( unsigned __int64 i, const BYTE *pkg, BYTE *pt  ) const;
+
+   // A whole container in memory; nThreads as for aes_ctr (whole chunks per thread).
+   // -- Encrypt, after Create: writes Size() bytes, header first
+   // -- Decrypt reads the header itself.  Returns false, with pt zeroed, unless the 
+   //    header, the size and every chunk check out.
+   BYTE *Encrypt( const BYTE *pt, BYTE *out, int nThreads = 0 ) const;
+   bool  Decrypt( const BYTE *in, size_t size, BYTE *pt, int nThreads = 0 );
+
+   // Random access, after ReadHeader: len bytes of plain text from pos, into out.  in is 
+   // the container, inLen bytes of it.  Only the chunks they fall in are checked and 
+   // decrypted.  False (out zeroed) if one fails or lies past inLen.
+   bool Read( const BYTE *in, size_t inLen, unsigned __int64 pos, size_t len, BYTE *out ) const;
+
+private:
+   AesCbcCmac128      _etm;
+   AesKey             _ivk;              // chunk IVs (the CBC key; SP 800-38A Appendix C)
+   CmacAes128         _hdrMac;           // header tag, under a key derived from macKey
+   BYTE               _hdr[HeaderLen];
+   unsigned __int64   _ptLen;
+   int                _chunkLen;
+
+   void _iv( unsigned __int64 i, BYTE *iv ) const;
+};
+
+
+// --------------------------------------------------------------------------------------
+// Hash traits: what a template over the hash function (HmacKeyT, HashCtxT) needs to know.  
+// Ctx is the running state, opaque, at most CtxLen bytes and copyable with memcpy.  
+// Chain() reads its chaining words, which are only complete after whole blocks.  The 
+// calls are direct, not through a pfnHash pointer.  Blocks() returns the CPU's best raw 
+// block function, h += compress( h, block ), for loops that pad their own blocks 
+// (PBKDF2).  (From SHA1.cpp and SHA2.cpp)
+// --------------------------------------------------------------------------------------
+struct Sha1Hash {
+   enum { BlockLen = 64, HashLen = SHA1_LEN, Words = 5, CtxLen = 96 };
+   typedef UINT Word;
+   struct Ctx;
+
+   static void  Init  ( Ctx *c );
+   static void  Update( Ctx *c, const BYTE *p, size_t cb );
+   static BYTE *Final ( Ctx *c, BYTE *out );               // out: HashLen bytes
+   static void  Chain ( const Ctx *c, Word h[Words] );
+
+   typedef void (* pfnBlocks)( Word *h, const BYTE *p, size_t num );
+   static pfnBlocks Blocks();
+};
+
+struct Sha256Hash {
+   enum { BlockLen = 64, HashLen = SHA256_LEN, Words = 8, CtxLen = 112 };
+   typedef UINT Word;
+   struct Ctx;
+
+   static void  Init  ( Ctx *c );
+   static void  Update( Ctx *c, const BYTE *p, size_t cb );
+   static BYTE *Final ( Ctx *c, BYTE *out );
+   static void  Chain ( const Ctx *c, Word h[Words] );
+
+   typedef void (* pfnBlocks)( Word *h, const BYTE *p, size_t num );
+   static pfnBlocks Blocks();
+};
+
+struct Sha512Hash {
+   enum { BlockLen = 128, HashLen = SHA512_LEN, Words = 8, CtxLen = 208 };
+   typedef unsigned __int64 Word;
+   struct Ctx;
+
+   static void  Init  ( Ctx *c );
+   static void  Update( Ctx *c, const BYTE *p, size_t cb );
+   static BYTE *Final ( Ctx *c, BYTE *out );
+   static void  Chain ( const Ctx *c, Word h[Words] );
+
+   typedef void (* pfnBlocks)( Word *h, const BYTE *p, size_t num );
+   static pfnBlocks Blocks();
+};
+
+
+// --------------------------------------------------------------------------------------
+// Incremental hash over traits H, for the SHA-2 hashes (Sha256Ctx, Sha512Ctx).  Like 
+// Sha1Ctx, minus Save/Restore.  Final re-inits the object.  (From SHA2.cpp)
+// --------------------------------------------------------------------------------------
+template <class H> class HashCtxT {
+public:
+   enum { HashLen = H::HashLen };
+   
+   HashCtxT();
+   HashCtxT( const HashCtxT &src );
+   HashCtxT &operator=( const HashCtxT &src );
+
+   void  Reset ();
+   void  Update( const BYTE *in, int inlen );
+   BYTE *Final ( BYTE *out );                // out must have room for HashLen bytes
+   
+   void  Clone( HashCtxT &dst ) const;
+   
+private:
+   KeyBuf _ctx;   // H::Ctx
+};
+
+typedef HashCtxT<Sha256Hash> Sha256Ctx;
+typedef HashCtxT<Sha512Hash> Sha512Ctx;
+
+
+// --------------------------------------------------------------------------------------
+// HMAC key context, over hash traits H.  The key is absorbed once, at construction, and 
+// the hash states after the (K ^ ipad) and (K ^ opad) blocks are kept.  Each MAC then 
+// starts from those midstates, saving two compression calls and all heap allocation 
+// compared with building the padded key per call.  (From HMAC.cpp)
+//
+// -- Mac() is one-shot and does not touch the streaming state.
+// -- Init/Update/Final MAC a message that arrives in pieces.  Final re-inits the object.
+// -- in both cases the text is hashed in place; it is never copied.
+// --------------------------------------------------------------------------------------
+template <class H> class HmacKeyT {
+public:
+   enum { MacLen = H::HashLen };
+   typedef typename H::Word Word;
+   
+   HmacKeyT( const BYTE *key, int keylen );
+
+   // out must have room for MacLen bytes.
+   BYTE *Mac( const BYTE *in, int inlen, BYTE *out ) const;
+
+   void  Init  ();
+   void  Update( const BYTE *in, int inlen );
+   BYTE *Final ( BYTE *out );
+
+   // Chaining values after the ipad and opad blocks (H::Words each).  For PRF loops 
+   // (PBKDF2) that run the compression function directly.
+   void  Midstates( Word *inner, Word *outer ) const;
+
+private:
+   KeyBuf _ctx;   // inner and outer midstates, and the streaming state
+
+   HmacKeyT( const HmacKeyT & );              // not copyable
+   HmacKeyT &operator=( const HmacKeyT & );
+};
+
+typedef HmacKeyT<Sha256Hash> HmacSha256Key;
+typedef HmacKeyT<Sha512Hash> HmacSha512Key;
 
 
 // --------------------------------------------------------------------------------------
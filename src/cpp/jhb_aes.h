@@ -0,0 +1,52 @@
+// ----------------------------------------------------------------------------
+//
+//  jhb_aes.h
+//
+//    Internal AES layer used by the jhbKrypto sources.  Picks AES-NI where the
+//    CPU has it, otherwise the bitsliced or OpenSSL table code.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef __JHB_AES_H__
+#define __JHB_AES_H__
+
+extern "C" {
+   #include <openssl/aes.h>
+}
+
+// The AES_KEY layout depends on the implementation chosen, so a schedule made by these
+// functions must only be used with these functions (not with AES_encrypt etc.).
+// -- set_key functions return 0 on success, as OpenSSL's do
+// -- aes_cbc_encrypt: len need not be a whole number of blocks (as AES_cbc_encrypt); 
+//    iv is not modified (as in this tree's cbc128.c)
+// -- any key size (128/192/256 bits); the AES-NI loops are built once per round count and
+//    picked by ks->rounds on entry, so no loop tests the key size
+int  aes_set_encrypt_key( const BYTE *key, int bits, AES_KEY *ks );
+int  aes_set_decrypt_key( const BYTE *key, int bits, AES_KEY *ks );
+
+void aes_encrypt( const BYTE *in, BYTE *out, const AES_KEY *ks );
+void aes_decrypt( const BYTE *in, BYTE *out, const AES_KEY *ks );
+
+// The expanded schedule held by an AesKeyT (any key size).
+const AES_KEY *aes_schedule( const _aes_key_t &key, bool bEncrypt );
+
+// ECB encryption of 'blocks' whole blocks.  Constant-time on every x86 path.
+void aes_ecb_encrypt( const BYTE *in, BYTE *out, size_t blocks, const AES_KEY *ks );
+
+void aes_cbc_encrypt( const BYTE *in, BYTE *out, size_t len, const AES_KEY *ks, const BYTE *iv, bool bEncrypt );
+
+// CBC-MAC over 'blocks' whole blocks, chaining from and into the 16 bytes at X.
+void aes_cbc_mac( const BYTE *in, size_t blocks, const AES_KEY *ks, BYTE *X );
+
+// CBC encryption of 'blocks' whole blocks (chain: the IV in, the last ciphertext block out)
+// and, in the same loop, a CBC-MAC under mks of each ciphertext block.  X is the pending
+// MAC block: the chaining value XORed with the last block absorbed, not yet encrypted.
+// (So X starts as the first MAC input block, and CMAC ends with E_mks( X ^ K1 ).)
+void aes_cbc_encrypt_mac( const BYTE *in, BYTE *out, size_t blocks, const AES_KEY *ks, BYTE *chain, 
+                          const AES_KEY *mks, BYTE *X );
+
+// CTR, the same both ways, starting 'block' blocks into the keystream for the 16-byte initial
+// counter block ctr (which is not modified).  ks is an encryption schedule.
+void aes_ctr_encrypt( const BYTE *in, BYTE *out, size_t len, const AES_KEY *ks, const BYTE *ctr, unsigned __int64 block );
+
+#endif // __JHB_AES_H__
@@ -0,0 +1,56 @@
+// ----------------------------------------------------------------------------
+//
+//  jhb_simd.h
+//
+//    Compile-time switches and intrinsic headers for the SIMD code paths in
+//    jhbKrypto.  Which paths actually run is decided at run time, from
+//    CpuFeatures().
+//
+// ----------------------------------------------------------------------------
+
+#ifndef __JHB_SIMD_H__
+#define __JHB_SIMD_H__
+
+// x86 / x64 only.  (The Windows Mobile ARM builds get the portable code.)
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+   #define JHB_X86
+   #ifdef _MSC_VER
+      #include <intrin.h>    // __cpuid, __cpuidex, _xgetbv
+   #else
+      #include <cpuid.h>     // __cpuid_count
+      #include <x86intrin.h>
+   #endif
+   #include <emmintrin.h>    // SSE2
+#endif
+
+// SSSE3 intrinsics: VS2008 and later.
+#if defined(JHB_X86) && (defined(__SSSE3__) || defined(_MSC_VER))
+   #define JHB_SSSE3
+   #include <tmmintrin.h>
+#endif
+
+// AES-NI and PCLMULQDQ intrinsics: VS2008 SP1 and later.
+#if defined(JHB_X86) && (defined(__AES__) || defined(_MSC_VER))
+   #define JHB_AESNI
+   #include <wmmintrin.h>
+#endif
+
+// PCLMULQDQ (in wmmintrin.h, like AES-NI).  GHASH also needs SSSE3's byte shuffle.
+#if defined(JHB_SSSE3) && (defined(__PCLMUL__) || defined(_MSC_VER))
+   #define JHB_PCLMUL
+   #include <wmmintrin.h>
+#endif
+
+// AVX2 intrinsics: VS2012 and later.
+#if defined(JHB_X86) && (defined(__AVX2__) || (defined(_MSC_VER) && (_MSC_VER >= 1700)))
+   #define JHB_AVX2
+   #include <immintrin.h>
+#endif
+
+// SHA extensions (SHA1RNDS4 etc.): VS2015 and later.
+#if defined(JHB_SSSE3) && (defined(__SHA__) || (defined(_MSC_VER) && (_MSC_VER >= 1900)))
+   #define JHB_SHANI
+   #include <immintrin.h>
+#endif
+
+#endif // __JHB_SIMD_H__